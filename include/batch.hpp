@@ -0,0 +1,262 @@
+// batch mode: many scans in one process, scheduled frame by frame under a memory budget
+//
+// every frame of every scan is a psf task (against the next frame), followed by a scale
+// task (resize + cut) once its psf is known, and every scan gets a merge task once all
+// its strips are done. a task only starts if its estimated memory fits into what is left
+// of the budget. the resized image is max_psf times as wide as the frame, so the scale
+// task is only estimated after the psf. each scan keeps its strips in its own directory
+// '<out_img>.parts', so scans never share intermediate files
+//
+// psf tasks keep CORRELATE_PARTS threads of correlate_pool() busy, so fewer of them run at
+// once than there are workers, the single threaded scale and merge tasks fill the rest.
+// a task that fails ends only its own scan, the other scans go on and the failed ones are
+// reported at the end
+
+#ifndef __BATCH_HPP
+#define __BATCH_HPP
+
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include "util.hpp"
+
+
+struct batch_scan {
+    std::string                 out_img;
+    std::string                 parts_dir;     // strips of this scan only
+    std::vector<std::string>    frames;
+    std::vector<std::string>    strips;
+    unsigned int                n_done  = 0;   // strips written so far
+    std::string                 error;         // set once a task of this scan failed
+};
+
+
+enum batch_stage { TASK_PSF, TASK_SCALE, TASK_MERGE };
+
+
+struct batch_task {
+    batch_scan*           scan;
+    batch_stage           stage;
+    int                   frame;       // unused for the merge task
+    uint64_t              mem;         // estimated peak memory in bytes
+    std::vector<float>    psf;         // scale task only
+    int                   maxshift  = 0;
+};
+
+
+// estimated peak memory of a psf task: both frames
+uint64_t psf_task_mem(const char* frame){
+    BMP_reader r(frame);
+    return (uint64_t) 2 * r.info_h.width * r.info_h.height * sizeof(pixel);
+}
+
+
+// estimated peak memory of a scale task: the frame and the copy psf_resize works on,
+// the resized image (max_psf times as wide) and the strip
+uint64_t scale_task_mem(const char* frame, const std::vector<float>& psf, int maxshift){
+    BMP_reader r(frame);
+    float max_psf = 0;
+    for(auto p : psf) max_psf = std::max(max_psf, p);
+    return (uint64_t) (2 * r.info_h.width + (uint64_t) (r.info_h.width * max_psf) + maxshift) * r.info_h.height * sizeof(pixel);
+}
+
+
+// estimated peak memory of a merge task: all strips plus the merged image
+// (strips are compressed on disk, but decoded in memory)
+uint64_t merge_task_mem(const batch_scan& scan){
+    uint64_t mem = 0;
+    for(auto& s : scan.strips){
+        BMP_reader r(s.c_str());
+        mem += (uint64_t) 2 * r.info_h.width * r.info_h.height * sizeof(pixel);
+    }
+    return mem;
+}
+
+
+
+struct batch_scheduler {
+
+    // at most max_psf of the n_workers run psf tasks at the same time
+    batch_scheduler(uint64_t budget, unsigned int n_workers, unsigned int max_psf, unsigned int resolution)
+    : budget(budget), n_workers(std::max(1u, n_workers)), max_psf(std::max(1u, max_psf)), resolution(resolution) {}
+
+
+    void add_scan(const char* img_dir, const char* out_img){
+        auto s = std::make_unique<batch_scan>();
+
+        s->out_img = out_img;
+        s->parts_dir = std::string(out_img) + ".parts";
+        s->frames = list_frames(img_dir);
+
+        if(s->frames.size() < 2){
+            throw std::runtime_error("Scan '" + std::string(img_dir) + "' needs at least 2 frames (got "
+                                    + std::to_string(s->frames.size()) + ")");
+        }
+
+        std::vector<batch_task> tasks;
+        for(int i=0; i<s->frames.size(); ++i){
+            s->strips.push_back(s->parts_dir + "/" + std::to_string(i) + ".flz");
+            tasks.push_back({ s.get(), TASK_PSF, i, psf_task_mem(s->frames[i].c_str()) });
+        }
+
+        std::filesystem::create_directories(s->parts_dir);
+
+        queue.insert(queue.end(), tasks.begin(), tasks.end());
+        scans.push_back(std::move(s));
+    }
+
+
+    // runs every task, returns when all scans are merged or failed
+    // returns false if some scans failed
+    bool run(){
+        auto start = std::chrono::steady_clock::now();
+        unsigned int n_frames = 0;
+        for(auto& s : scans) n_frames += s->frames.size();
+
+        std::cout << "[*] batch: " << scans.size() << " scans, " << n_frames << " frames, "
+                  << n_workers << " workers (" << max_psf << " for psf), budget " << (budget >> 20) << " MiB" << std::endl;
+
+        std::vector<std::thread> workers;
+        for(int i=0; i<n_workers; ++i) workers.emplace_back(&batch_scheduler::worker, this);
+        for(auto& w : workers) w.join();
+
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "[.] batch done in " << s << " s (" << n_frames / s << " frames/s, peak estimate "
+                  << (peak >> 20) << " MiB)" << std::endl;
+
+        int n_failed = 0;
+        for(auto& s : scans){
+            if(s->error.empty()) continue;
+            std::cerr << "Scan '" << s->out_img << "' failed: " << s->error << std::endl;
+            remove_parts(*s);
+            ++n_failed;
+        }
+        if(n_failed) std::cerr << n_failed << " of " << scans.size() << " scans failed" << std::endl;
+
+        scans.clear();
+        return n_failed == 0;
+    }
+
+
+private:
+
+    uint64_t                    budget;
+    unsigned int                n_workers;
+    unsigned int                max_psf;
+    unsigned int                resolution;
+
+    std::vector<std::unique_ptr<batch_scan>>
+                                scans;
+    std::mutex                  mtx;
+    std::condition_variable     cv;
+    std::deque<batch_task>      queue;          // tasks ready to run, oldest first
+    uint64_t                    in_use   = 0;   // estimated memory of running tasks
+    uint64_t                    peak     = 0;
+    unsigned int                running  = 0;
+    unsigned int                running_psf  = 0;
+
+
+    // first queued task that fits into the budget. a task bigger than the whole budget
+    // runs alone, otherwise it could never start
+    bool pick(batch_task& t){
+        for(auto it=queue.begin(); it!=queue.end(); ++it){
+            if(it->stage == TASK_PSF && running_psf >= max_psf) continue;
+            if(in_use + it->mem <= budget || running == 0){
+                t = *it;
+                queue.erase(it);
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    void worker(){
+        while(true){
+            batch_task t{ nullptr, TASK_PSF, 0, 0 };
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                cv.wait(lk, [&]{ return (queue.empty() && running == 0) || pick(t); });
+                if(!t.scan) return;
+                ++running;
+                if(t.stage == TASK_PSF) ++running_psf;
+                in_use += t.mem;
+                peak = std::max(peak, in_use);
+            }
+
+            bool merge_ready = false;
+            uint64_t merge_mem = 0;
+            batch_task scale{ t.scan, TASK_SCALE, t.frame, 0 };
+            batch_scan& s = *t.scan;
+            std::string error;
+
+            // a failing task ends its scan only, like a failing step of one run.sh -f
+            try{
+                if(t.stage == TASK_PSF){
+                    int next = (t.frame + 1) % s.frames.size();    // last frame pairs with the first, like run.sh
+                    BMP_image a(s.frames[t.frame].c_str());
+                    BMP_image b(s.frames[next].c_str());
+                    scale.psf = calc_psf(a, b, &scale.maxshift, resolution);
+                    scale.mem = scale_task_mem(s.frames[t.frame].c_str(), scale.psf, scale.maxshift);
+                }
+                else if(t.stage == TASK_SCALE){
+                    BMP_image a(s.frames[t.frame].c_str());
+                    cut_strip(psf_resize(a, t.psf, resolution), t.maxshift).save_as(s.strips[t.frame].c_str());
+
+                    {
+                        std::lock_guard<std::mutex> lk(mtx);
+                        merge_ready = ++s.n_done == s.frames.size();
+                    }
+                    // estimated outside the lock, it reads the strip headers
+                    if(merge_ready) merge_mem = merge_task_mem(s);
+                }
+                else{
+                    std::vector<const char*> strips;
+                    for(auto& f : s.strips) strips.push_back(f.c_str());
+                    op_merge(s.out_img.c_str(), strips);
+                    remove_parts(s);
+                    std::cout << "[.] " << s.out_img << std::endl;
+                }
+            }
+            catch(const std::exception& e){
+                error = e.what();
+            }
+
+            std::lock_guard<std::mutex> lk(mtx);
+            if(!error.empty() && s.error.empty()){
+                // the scan's queued tasks are dropped, running ones finish but queue nothing
+                s.error = error;
+                queue.erase(std::remove_if(queue.begin(), queue.end(), [&](const batch_task& q){ return q.scan == &s; }), queue.end());
+                std::cerr << "Scan '" << s.out_img << "' failed: " << error << std::endl;
+            }
+            if(s.error.empty()){
+                // a strip is finished before new frames are started
+                if(t.stage == TASK_PSF) queue.push_front(std::move(scale));
+                if(merge_ready) queue.push_back({ t.scan, TASK_MERGE, 0, merge_mem });
+            }
+            --running;
+            if(t.stage == TASK_PSF) --running_psf;
+            in_use -= t.mem;
+            cv.notify_all();
+        }
+    }
+
+
+    // removes the strips of scan s and its parts directory, if nothing else is in there
+    static void remove_parts(const batch_scan& s){
+        std::error_code ec;
+        for(auto& f : s.strips) std::filesystem::remove(f, ec);
+        std::filesystem::remove(s.parts_dir, ec);
+    }
+
+};
+
+
+
+#endif // __BATCH_HPP
@@ -6,9 +6,11 @@
 #include <iomanip>
 #include <fstream>
 #include <map>
+#include <memory>
 #include <thread>
 #include <cmath>
 #include "pixel.hpp"
+#include "flz.hpp"
 
 
 // if a correlation result has a score lower than this, a warning will be shown
@@ -148,12 +150,17 @@ struct BMP_image {
 
         filenm = filename;
 
+        // compressed intermediate (flz.hpp)
+        if(flz_file(filename)){
+            read_flz(filename);
+            return;
+        }
+
         std::ifstream in(filename, std::ios::binary);
 
         if(!in){
             // error opening file
-            std::cerr << "Unable to read file \'" << filename << "\'" << std::endl;
-            exit(EXIT_FAILURE);
+            throw std::runtime_error("Unable to read file '" + std::string(filename) + "'");
         }
 
         // read file header
@@ -161,8 +168,7 @@ struct BMP_image {
 
         // if first 2 bytes don't match BM
         if(file_h.file_type != 0x4D42){
-            std::cerr << "File \'" << filename << "\' is not a BMP file" << std::endl;
-            exit(EXIT_FAILURE);
+            throw std::runtime_error("File '" + std::string(filename) + "' is not a BMP file");
         }
 
         // read DIB header
@@ -225,18 +231,24 @@ struct BMP_image {
     void save_as(const char *filename){
         filenm = filename;
 
+        // compressed intermediate (flz.hpp), chosen by the file name
+        if(flz_name(filename)){
+            FLZ_writer flz(filename, info_h.width, info_h.height);
+            flz.write_rows(data, info_h.height);
+            flz.finish();
+            return;
+        }
+
         std::ofstream out(filename, std::ios::binary);
 
         if(!out){
             // error opening file
-            std::cerr << "Unable to write to file \'" << filename << "\'" << std::endl;
-            exit(EXIT_FAILURE);
+            throw std::runtime_error("Unable to write to file '" + std::string(filename) + "'");
         }
 
         // can't work with other bits per pixel values
         if(info_h.bit_count != 24 && info_h.bit_count != 32){
-            std::cerr << "Can't work with bpp values other than 32 or 24 (bpp is " << info_h.bit_count << ")" << std::endl;
-            exit(EXIT_FAILURE);
+            throw std::runtime_error("Can't work with bpp values other than 32 or 24 (bpp is " + std::to_string(info_h.bit_count) + ")");
         }
 
         write_h_p(out);
@@ -257,8 +269,12 @@ struct BMP_image {
     }
 
 
-    friend std::pair<int, float> x_correlate(const BMP_image& a, std::pair<int, int> a_start, std::pair<int, int> a_end,
-                                             const BMP_image& b, std::pair<int, int> b_start, std::pair<int, int> b_end);
+    const std::string& filename() const {
+        return filenm;
+    }
+
+
+    friend struct BMP_reader;
 
 private:
 
@@ -280,6 +296,177 @@ private:
         }
     }
 
+
+    // reads an FLZ file, the image is then like a new 32 bpp one
+    void read_flz(const char *filename){
+        FLZ_reader flz(filename);
+
+        info_h.size = sizeof(BMP_info_header);
+        info_h.width = flz.header.width;
+        info_h.height = flz.header.height;
+        info_h.bit_count = 32;
+        file_h.pxl_offset = sizeof(BMP_file_header) + sizeof(BMP_info_header);
+        file_h.file_size = file_h.pxl_offset + info_h.width * info_h.height * 4;
+        neg_height = true;
+
+        // decoded before data owns it, a corrupt file must not leak the buffer
+        std::unique_ptr<pixel[]> buf(new pixel[info_h.width * info_h.height]);
+        flz.read_rows(0, info_h.height, buf.get());
+        data = buf.release();
+    }
+
+};
+
+
+
+// reads a BMP (or FLZ) file band by band (groups of consecutive rows)
+// only the headers and the requested band are held in memory
+struct BMP_reader {
+
+    BMP_file_header   file_h;
+    BMP_info_header   info_h;
+
+
+    BMP_reader(const char *filename)
+    : filenm(filename), in(filename, std::ios::binary)
+    {
+        if(!in){
+            // error opening file
+            throw std::runtime_error("Unable to read file '" + std::string(filename) + "'");
+        }
+
+        if(flz_file(filename)){
+            flz = new FLZ_reader(filename);
+            info_h.size = sizeof(BMP_info_header);
+            info_h.width = flz->header.width;
+            info_h.height = flz->header.height;
+            info_h.bit_count = 32;
+            return;
+        }
+
+        in.read((char*) &file_h, sizeof file_h);
+
+        // if first 2 bytes don't match BM
+        if(file_h.file_type != 0x4D42){
+            throw std::runtime_error("File '" + std::string(filename) + "' is not a BMP file");
+        }
+
+        in.read((char*) &info_h, sizeof info_h);
+
+        if(info_h.height < 0) info_h.height = abs(info_h.height);
+
+        // same padding rules as BMP_image::read
+        if(info_h.bit_count/8 % 4 != 0 && info_h.width % 4 != 0)
+            padding = 4 - ((info_h.width * info_h.bit_count/8) % 4);
+    }
+
+
+    // reads n rows starting at row (in file order, like BMP_image::data)
+    BMP_image read_rows(unsigned int row, unsigned int n){
+        if(row + n > info_h.height){
+            throw std::runtime_error("Rows out of range: " + std::to_string(row) + " - " + std::to_string(row+n-1));
+        }
+
+        BMP_image band(info_h.width, n);
+        band.filenm = filenm;
+
+        if(flz){
+            flz->read_rows(row, n, band.data);
+            return band;
+        }
+
+        unsigned int row_bytes = info_h.width * info_h.bit_count/8;
+        in.seekg(file_h.pxl_offset + (std::streamoff) row * (row_bytes + padding), in.beg);
+
+        for(int r=0; r<n; ++r){
+            in.read((char*) &band.data[r * info_h.width], row_bytes);
+            in.ignore(padding);
+        }
+
+        return band;
+    }
+
+
+    ~BMP_reader(){
+        delete flz;
+    }
+
+private:
+
+    std::string     filenm;
+    std::ifstream   in;
+    unsigned int    padding  = 0;
+    FLZ_reader*     flz      {nullptr};     // set for FLZ files
+};
+
+
+
+// writes a 32 bpp BMP file band by band, bands are appended top to bottom
+// produces the same bytes as BMP_image(width, height) filled and saved in one go
+// (an FLZ file if filename ends with .flz)
+struct BMP_writer {
+
+    BMP_writer(const char *filename, unsigned int width, unsigned int height)
+    : filenm(filename), width(width), height(height)
+    {
+        if(flz_name(filename)){
+            flz = new FLZ_writer(filename, width, height);
+            return;
+        }
+
+        out.open(filename, std::ios::binary);
+        if(!out){
+            // error opening file
+            throw std::runtime_error("Unable to write to file '" + std::string(filename) + "'");
+        }
+
+        BMP_file_header file_h;
+        BMP_info_header info_h;
+
+        info_h.size = sizeof(BMP_info_header);
+        info_h.width = width;
+        info_h.height = -(int32_t) height;   // top to bottom
+        info_h.bit_count = 32;
+        file_h.pxl_offset = sizeof(BMP_file_header) + sizeof(BMP_info_header);
+        file_h.file_size = file_h.pxl_offset + width * height * 4;
+
+        out.write((const char*) &file_h, sizeof file_h);
+        out.write((const char*) &info_h, sizeof info_h);
+    }
+
+
+    ~BMP_writer(){
+        if(rows_written != height){
+            std::cerr << "Warning: '" << filenm << "' closed after " << rows_written
+                      << " of " << height << " rows" << std::endl;
+        }
+
+        if(flz){
+            flz->finish();
+            delete flz;
+        }
+    }
+
+
+    // appends all rows of band
+    void write_rows(const BMP_image& band){
+        if(band.info_h.width != width || rows_written + band.info_h.height > height){
+            throw std::runtime_error("Band of size " + std::to_string(band.info_h.width) + "x" + std::to_string(band.info_h.height)
+                                    + " does not fit into '" + filenm + "'");
+        }
+        if(flz) flz->write_rows(band.data, band.info_h.height);
+        else out.write((const char*) band.data, width * band.info_h.height * sizeof(pixel));
+        rows_written += band.info_h.height;
+    }
+
+private:
+
+    std::string     filenm;
+    std::ofstream   out;
+    unsigned int    width;
+    unsigned int    height;
+    unsigned int    rows_written  = 0;
+    FLZ_writer*     flz           {nullptr};     // set for .flz files
 };
 
 
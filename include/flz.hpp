@@ -0,0 +1,260 @@
+// FLZ - compact format for intermediate images (scaled strips)
+//
+// every row is stored on its own: each pixel as the per-byte difference to its left
+// neighbour, the differences run-length coded in 32 bit words. the mostly flat background
+// becomes long runs of zero, smooth gradients runs of a constant. a row ends once it has
+// width pixels, an index with the offset of every FLZ_BLOCK-th row at the end of the file
+// allows reading any band of rows
+//
+// layout: FLZ_header, rows, index (height/FLZ_BLOCK rounded up, plus 1, uint64 offsets)
+// a row is a sequence of tokens, each starting with byte c:
+//     c <  128  :  c+1 literal words follow
+//     c >= 128  :  one word follows, repeated c-126 times (2 ... 129)
+
+#ifndef __FLZ_HPP
+#define __FLZ_HPP
+
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "pixel.hpp"
+
+
+#define FLZ_MAGIC 0x315A4C46      // "FLZ1"
+#define FLZ_BLOCK 64              // rows per index entry
+
+
+#pragma pack(push, 1)
+struct FLZ_header {
+    uint32_t   magic        { FLZ_MAGIC };
+    int32_t    width        { 0 };
+    int32_t    height       { 0 };
+    uint64_t   index        { 0 };       // file offset of the row index
+};
+#pragma pack(pop)
+
+
+// true if filename has the .flz extension, images saved under such names are compressed
+bool flz_name(const char* filename){
+    size_t n = strlen(filename);
+    return n >= 4 && !strcmp(filename + n - 4, ".flz");
+}
+
+
+// true if the file starts with the FLZ magic number
+bool flz_file(const char* filename){
+    std::ifstream in(filename, std::ios::binary);
+    uint32_t magic = 0;
+    in.read((char*) &magic, sizeof magic);
+    return magic == FLZ_MAGIC;
+}
+
+
+// per-byte a-b and a+b of two pixels packed into words, without carries between the bytes
+inline uint32_t flz_sub(uint32_t a, uint32_t b){
+    return ((a | 0x80808080) - (b & 0x7F7F7F7F)) ^ ((a ^ ~b) & 0x80808080);
+}
+
+inline uint32_t flz_add(uint32_t a, uint32_t b){
+    return ((a & 0x7F7F7F7F) + (b & 0x7F7F7F7F)) ^ ((a ^ b) & 0x80808080);
+}
+
+
+// appends the coded row of w pixels to out
+void flz_encode_row(const pixel4* row, unsigned int w, std::string& out){
+    std::vector<uint32_t> d(w);
+    uint32_t prev = 0;
+    for(int i=0; i<w; ++i){
+        uint32_t p;
+        memcpy(&p, &row[i], sizeof p);
+        d[i] = flz_sub(p, prev);
+        prev = p;
+    }
+
+    unsigned int i = 0;
+    while(i < w){
+        // run of equal words starting at i
+        unsigned int run = 1;
+        while(i + run < w && run < 129 && d[i + run] == d[i]) ++run;
+
+        if(run >= 2){
+            out += (char) (run + 126);
+            out.append((const char*) &d[i], sizeof(uint32_t));
+            i += run;
+            continue;
+        }
+
+        // literals up to the next run of at least 2
+        unsigned int lit = 1;
+        while(i + lit < w && lit < 128 && !(i + lit + 1 < w && d[i + lit] == d[i + lit + 1])) ++lit;
+
+        out += (char) (lit - 1);
+        out.append((const char*) &d[i], lit * sizeof(uint32_t));
+        i += lit;
+    }
+}
+
+
+// decodes a row of w pixels from in, returns where the next row starts
+const char* flz_decode_row(const char* in, const char* end, pixel4* row, unsigned int w){
+    uint32_t prev = 0;
+    unsigned int i = 0;
+
+    while(i < w){
+        if(in >= end) throw std::runtime_error("Corrupt FLZ row");
+
+        unsigned int c = (uint8_t) *in++;
+        unsigned int cnt = c < 128 ? c + 1 : c - 126;
+        size_t bytes = c < 128 ? cnt * sizeof(uint32_t) : sizeof(uint32_t);
+
+        if(i + cnt > w || in + bytes > end) throw std::runtime_error("Corrupt FLZ row");
+
+        if(c < 128){
+            for(int k=0; k<cnt; ++k, in+=sizeof(uint32_t)){
+                uint32_t d;
+                memcpy(&d, in, sizeof d);
+                prev = flz_add(prev, d);
+                memcpy(&row[i++], &prev, sizeof prev);
+            }
+        }
+        else{
+            uint32_t d;
+            memcpy(&d, in, sizeof d);
+            in += sizeof d;
+            if(d == 0){
+                // flat run, the common case
+                pixel4 p;
+                memcpy(&p, &prev, sizeof p);
+                std::fill(&row[i], &row[i + cnt], p);
+                i += cnt;
+            }
+            else{
+                for(int k=0; k<cnt; ++k){
+                    prev = flz_add(prev, d);
+                    memcpy(&row[i++], &prev, sizeof prev);
+                }
+            }
+        }
+    }
+
+    return in;
+}
+
+
+
+// writes an FLZ file row by row, top to bottom
+struct FLZ_writer {
+
+    FLZ_writer(const char* filename, unsigned int width, unsigned int height)
+    : filenm(filename), out(filename, std::ios::binary)
+    {
+        if(!out){
+            // error opening file
+            throw std::runtime_error("Unable to write to file '" + std::string(filename) + "'");
+        }
+
+        header.width = width;
+        header.height = height;
+        out.write((const char*) &header, sizeof header);
+        pos = sizeof header;
+    }
+
+
+    void write_rows(const pixel4* data, unsigned int n){
+        for(int r=0; r<n; ++r, ++rows){
+            if(rows % FLZ_BLOCK == 0) offsets.push_back(pos);
+            buf.clear();
+            flz_encode_row(&data[r * header.width], header.width, buf);
+            out.write(buf.data(), buf.size());
+            pos += buf.size();
+        }
+    }
+
+
+    // writes the index, all rows must have been written
+    void finish(){
+        offsets.push_back(pos);
+        header.index = pos;
+        out.write((const char*) offsets.data(), offsets.size() * sizeof(uint64_t));
+        out.seekp(0, out.beg);
+        out.write((const char*) &header, sizeof header);
+        out.close();
+    }
+
+private:
+
+    std::string              filenm;
+    std::ofstream            out;
+    FLZ_header               header;
+    std::vector<uint64_t>    offsets;     // start of every FLZ_BLOCK-th row
+    uint64_t                 pos   = 0;   // current file offset
+    unsigned int             rows  = 0;   // rows written so far
+    std::string              buf;
+};
+
+
+
+// reads bands of rows from an FLZ file
+struct FLZ_reader {
+
+    FLZ_header   header;
+
+
+    FLZ_reader(const char* filename)
+    : filenm(filename), in(filename, std::ios::binary)
+    {
+        in.read((char*) &header, sizeof header);
+        if(!in || header.magic != FLZ_MAGIC || header.width <= 0 || header.height <= 0){
+            throw std::runtime_error("File '" + std::string(filename) + "' is not an FLZ file");
+        }
+
+        // a writer that died before finish() left index 0, the index has to fit between
+        // the rows and the end of the file and its offsets must run through the rows in order
+        in.seekg(0, in.end);
+        uint64_t size = in.tellg();
+        offsets.resize((header.height + FLZ_BLOCK-1) / FLZ_BLOCK + 1);
+
+        if(header.index < sizeof header || header.index > size || size - header.index < offsets.size() * sizeof(uint64_t)){
+            throw std::runtime_error("File '" + std::string(filename) + "' is truncated");
+        }
+
+        in.seekg(header.index, in.beg);
+        in.read((char*) offsets.data(), offsets.size() * sizeof(uint64_t));
+        if(!in || offsets.front() != sizeof header || offsets.back() != header.index
+           || !std::is_sorted(offsets.begin(), offsets.end())){
+            throw std::runtime_error("File '" + std::string(filename) + "' is truncated");
+        }
+    }
+
+
+    // decodes n rows starting at row into data
+    void read_rows(unsigned int row, unsigned int n, pixel4* data){
+        // whole blocks are read, rows before row are decoded and dropped
+        unsigned int b0 = row / FLZ_BLOCK, b1 = (row + n - 1) / FLZ_BLOCK + 1;
+        buf.resize(offsets[b1] - offsets[b0]);
+        in.seekg(offsets[b0], in.beg);
+        in.read(buf.data(), buf.size());
+
+        const char* p = buf.data();
+        const char* end = p + buf.size();
+        skip.resize(header.width);
+        for(unsigned int r=b0*FLZ_BLOCK; r<row; ++r) p = flz_decode_row(p, end, skip.data(), header.width);
+        for(int r=0; r<n; ++r) p = flz_decode_row(p, end, &data[r * header.width], header.width);
+    }
+
+private:
+
+    std::string              filenm;
+    std::ifstream            in;
+    std::vector<uint64_t>    offsets;
+    std::vector<char>        buf;
+    std::vector<pixel4>      skip;
+};
+
+
+
+#endif // __FLZ_HPP
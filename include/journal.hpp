@@ -0,0 +1,166 @@
+// checkpoint journal, so an interrupted run can resume where it stopped
+//
+// every finished per-frame result (psf profile, scaled strip) gets one record appended
+// to the journal: the output file name, a signature of the inputs it was made from
+// (names, sizes and modification times of the input files, and the options that change
+// the result) and the size and crc32 of the output. each
+// record carries its own crc32, so a record torn by a crash is detected and dropped.
+// a result counts as done only if its record is valid, the inputs still match and
+// the file on disk still has the recorded size and checksum
+
+#ifndef __JOURNAL_HPP
+#define __JOURNAL_HPP
+
+
+#include <string>
+#include <vector>
+#include <map>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+#define JOURNAL_MAGIC 0x4A544C46      // "FLTJ"
+
+
+#pragma pack(push, 1)
+struct journal_record {
+    uint32_t   magic        { JOURNAL_MAGIC };
+    uint32_t   name_len     { 0 };       // length of the output file name following the record
+    uint64_t   inputs       { 0 };       // signature of the inputs
+    uint64_t   size         { 0 };       // size of the output file
+    uint32_t   crc          { 0 };       // crc32 of the output file
+};
+#pragma pack(pop)
+
+
+uint32_t crc32(const void* buf, size_t len, uint32_t crc = 0){
+    static uint32_t table[256] = {};
+    if(!table[1]){
+        for(uint32_t i=0; i<256; ++i){
+            uint32_t c = i;
+            for(int k=0; k<8; ++k) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+
+    const uint8_t* p = (const uint8_t*) buf;
+    crc = ~crc;
+    for(size_t i=0; i<len; ++i) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+// crc32 of a whole file, false if it can't be read
+bool file_crc32(const std::string& filename, uint64_t* size, uint32_t* crc){
+    std::ifstream in(filename, std::ios::binary);
+    if(!in) return false;
+
+    std::vector<char> buf(1 << 16);
+    *size = 0;
+    *crc = 0;
+    while(in.read(buf.data(), buf.size()) || in.gcount()){
+        *crc = crc32(buf.data(), in.gcount(), *crc);
+        *size += in.gcount();
+    }
+    return true;
+}
+
+
+// cheap signature of input files: names, sizes and modification times, contents aren't read.
+// options is whatever else the output depends on (command line options, resolution)
+uint64_t inputs_signature(const std::vector<std::string>& inputs, const std::string& options){
+    uint64_t sig = crc32(options.data(), options.size());
+    for(auto& f : inputs){
+        std::error_code ec;
+        auto size = std::filesystem::file_size(f, ec);
+        auto time = std::filesystem::last_write_time(f, ec).time_since_epoch().count();
+
+        sig = sig * 0x100000001B3 ^ crc32(f.data(), f.size());
+        sig = sig * 0x100000001B3 ^ size;
+        sig = sig * 0x100000001B3 ^ (uint64_t) time;
+    }
+    return sig;
+}
+
+
+
+struct journal {
+
+    // reads and validates the journal, a torn or corrupt tail is cut off
+    journal(const char* filename)
+    : filename(filename)
+    {
+        std::ifstream in(filename, std::ios::binary);
+        uint64_t valid = 0;
+
+        journal_record rec;
+        std::string name;
+        uint32_t rec_crc;
+
+        while(in.read((char*) &rec, sizeof rec)){
+            if(rec.magic != JOURNAL_MAGIC || rec.name_len > 4096) break;
+
+            name.resize(rec.name_len);
+            if(!in.read(&name[0], rec.name_len) || !in.read((char*) &rec_crc, sizeof rec_crc)) break;
+            if(crc32(name.data(), name.size(), crc32(&rec, sizeof rec)) != rec_crc) break;
+
+            records[name] = rec;    // later records win, an output may be redone
+            valid += sizeof rec + rec.name_len + sizeof rec_crc;
+        }
+        in.close();
+
+        std::error_code ec;
+        if(std::filesystem::exists(filename, ec) && std::filesystem::file_size(filename, ec) != valid){
+            std::cerr << "Journal \'" << filename << "\' has a damaged tail, dropping it" << std::endl;
+            std::filesystem::resize_file(filename, valid, ec);
+        }
+    }
+
+
+    // true if out was made from inputs with options and is still intact
+    bool done(const std::string& out, const std::vector<std::string>& inputs, const std::string& options) const {
+        auto it = records.find(out);
+        if(it == records.end() || it->second.inputs != inputs_signature(inputs, options)) return false;
+
+        uint64_t size;
+        uint32_t crc;
+        return file_crc32(out, &size, &crc) && size == it->second.size && crc == it->second.crc;
+    }
+
+
+    // records out as done, the record is on disk when this returns
+    void commit(const std::string& out, const std::vector<std::string>& inputs, const std::string& options){
+        journal_record rec;
+        rec.name_len = out.size();
+        rec.inputs = inputs_signature(inputs, options);
+        if(!file_crc32(out, &rec.size, &rec.crc)) throw std::runtime_error("Unable to read '" + out + "' for the journal");
+
+        uint32_t rec_crc = crc32(out.data(), out.size(), crc32(&rec, sizeof rec));
+
+        std::string buf((const char*) &rec, sizeof rec);
+        buf += out;
+        buf.append((const char*) &rec_crc, sizeof rec_crc);
+
+        // a single O_APPEND write, so processes sharing a journal don't interleave records
+        int fd = open(filename.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if(fd < 0 || write(fd, buf.data(), buf.size()) != (ssize_t) buf.size() || fdatasync(fd) < 0){
+            if(fd >= 0) close(fd);
+            throw std::runtime_error("Unable to append to journal '" + filename + "'");
+        }
+        close(fd);
+
+        records[out] = rec;
+    }
+
+
+private:
+
+    std::string                               filename;
+    std::map<std::string, journal_record>     records;
+
+};
+
+
+
+#endif // __JOURNAL_HPP
@@ -0,0 +1,237 @@
+// incremental live-capture mode: the panorama grows frame by frame
+//
+// each new frame is correlated against the previous one, the previous frame's strip
+// is cut, its seam blended and saved as <out_img>.strips/<k>.bmp. a line "<k> <width>"
+// is appended to <out_img>.strips/index.txt once the strip is on disk, so a viewer can
+// show the panorama so far from the strips listed there, each one a frame after capture.
+//
+// bmps are stored row by row, so strips (columns) can't be appended to out_img itself:
+// when the capture ends, out_img is assembled from the strips in one banded pass, which
+// rereads and rewrites the whole panorama (O(panorama), not O(frame) like the strips).
+// the strips are removed afterwards
+
+#ifndef __LIVE_HPP
+#define __LIVE_HPP
+
+
+#include <string>
+#include <vector>
+#include <set>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include "util.hpp"
+
+
+#define LIVE_POLL_MS     50    // how often the watched directory is listed
+#define LIVE_BAND_ROWS   64    // rows assembled at a time when the capture ends
+
+
+struct live_panorama {
+
+    live_panorama(const char* out_img, unsigned int resolution)
+    : out_img(out_img), strips_dir(std::string(out_img) + ".strips"), resolution(resolution)
+    {
+        std::filesystem::create_directories(strips_dir);
+        index.open(strips_dir / "index.txt", std::ios::trunc);
+        if(!index){
+            // error opening file
+            throw std::runtime_error("Unable to write to file '" + (strips_dir / "index.txt").string() + "'");
+        }
+    }
+
+
+    // processes a newly captured frame, work does not depend on the number of frames so far
+    void add_frame(const char* filename){
+        auto start = std::chrono::steady_clock::now();
+
+        auto cur = std::make_unique<BMP_image>(filename);
+
+        if(first && cur->info_h.height != first->info_h.height){
+            throw std::runtime_error("Frame '" + std::string(filename) + "' has height " + std::to_string(cur->info_h.height)
+                                    + ", expected " + std::to_string(first->info_h.height));
+        }
+
+        if(!first) first = std::move(cur);
+        else{
+            push_strip(frame_strip(prev_frame(), *cur, resolution));
+            prev = std::move(cur);
+        }
+        ++n_frames;
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "\rLive: frame " << n_frames << " (" << (int) ms << " ms)" << std::flush;
+    }
+
+
+    // closes the loop (last frame against the first one, like run.sh) and writes out_img,
+    // the last strip is available right away, out_img after a pass over the whole panorama
+    void finish(){
+        std::cout << std::endl;
+
+        if(n_frames < 2){
+            throw std::runtime_error("Live capture needs at least 2 frames (got " + std::to_string(n_frames) + ")");
+        }
+
+        push_strip(frame_strip(prev_frame(), *first, resolution));
+        prev.reset();
+        first.reset();
+
+        write_strip(*last);
+        index.close();
+
+        assemble();
+
+        // only what this capture wrote, the directory goes if nothing else is in it
+        std::error_code ec;
+        for(int k=0; k<widths.size(); ++k) std::filesystem::remove(strip_file(k), ec);
+        std::filesystem::remove(strips_dir / "index.txt", ec);
+        std::filesystem::remove(strips_dir, ec);
+    }
+
+
+private:
+
+    std::string               out_img;
+    std::filesystem::path     strips_dir;
+    std::ofstream             index;
+    unsigned int     resolution;
+    unsigned int     n_frames  = 0;
+
+    std::unique_ptr<BMP_image>   first;      // needed again for the last psf
+    std::unique_ptr<BMP_image>   prev;       // previous frame, empty while that is the first one
+    std::unique_ptr<BMP_image>   last;       // last strip, not spooled until its right seam is blended
+
+    std::vector<unsigned int>   widths;      // widths of the strips written so far, in order
+
+
+    const BMP_image& prev_frame() const {
+        return prev ? *prev : *first;
+    }
+
+
+    void push_strip(BMP_image&& strip){
+        auto s = std::make_unique<BMP_image>(std::move(strip));
+
+        if(last){
+            // same seam as merge, on the 4 columns either side
+            int lw = last->info_h.width, h = s->info_h.height;
+            BMP_image seam(9, h);
+            for(int j=0; j<h; ++j){
+                for(int i=0; i<4; ++i) seam(i, j) = last->ploc(lw-4+i, j);
+                for(int i=4; i<9; ++i) seam(i, j) = s->ploc(i-4, j);
+            }
+            blend_seam(seam, 4);
+            for(int j=0; j<h; ++j){
+                for(int i=0; i<4; ++i) (*last)(lw-4+i, j) = seam(i, j);
+                for(int i=4; i<8; ++i) (*s)(i-4, j) = seam(i, j);
+            }
+
+            write_strip(*last);
+        }
+        last = std::move(s);
+    }
+
+
+    std::string strip_file(int k) const {
+        return (strips_dir / (std::to_string(k) + ".bmp")).string();
+    }
+
+
+    void write_strip(BMP_image& strip){
+        strip.save_as(strip_file(widths.size()).c_str());
+        index << widths.size() << " " << strip.info_h.width << std::endl;
+        widths.push_back(strip.info_h.width);
+    }
+
+
+    // writes the final image, reading LIVE_BAND_ROWS rows of every strip at a time
+    void assemble(){
+        unsigned int height = last->info_h.height;
+        unsigned int total_w = 0;
+        for(auto w : widths) total_w += w;
+        last.reset();
+
+        std::deque<BMP_reader> strips;
+        for(int k=0; k<widths.size(); ++k) strips.emplace_back(strip_file(k).c_str());
+
+        BMP_writer out(out_img.c_str(), total_w, height);
+
+        for(unsigned int r0=0; r0<height; r0+=LIVE_BAND_ROWS){
+            unsigned int n = std::min((unsigned int) LIVE_BAND_ROWS, height - r0);
+            BMP_image band(total_w, n);
+            unsigned int col = 0;
+
+            for(auto& s : strips){
+                BMP_image part = s.read_rows(r0, n);
+                unsigned int w = part.info_h.width;
+                for(int j=0; j<n; ++j) std::copy(&part.data[j*w], &part.data[(j+1)*w], &band(col, j));
+                col += w;
+            }
+
+            out.write_rows(band);
+        }
+    }
+
+};
+
+
+
+// true if a BMP file has been fully written (size on disk matches its header)
+bool bmp_complete(const std::filesystem::path& p){
+    std::ifstream in(p, std::ios::binary);
+    BMP_file_header file_h;
+    BMP_info_header info_h;
+    if(!in.read((char*) &file_h, sizeof file_h) || !in.read((char*) &info_h, sizeof info_h)) return false;
+
+    std::error_code ec;
+    auto size = std::filesystem::file_size(p, ec);
+    unsigned int row_bytes = (info_h.width * info_h.bit_count/8 + 3) / 4 * 4;
+    return !ec && size >= file_h.pxl_offset + (uintmax_t) abs(info_h.height) * row_bytes;
+}
+
+
+// frame file names are read from stdin, one per line, until EOF
+void live_from_stdin(live_panorama& pano){
+    std::string line;
+    while(std::getline(std::cin, line)){
+        if(!line.empty()) pano.add_frame(line.c_str());
+    }
+    pano.finish();
+}
+
+
+// frames are picked up from dir as they appear, until a file named '.done' is created there
+void live_from_dir(live_panorama& pano, const char* dir){
+    std::set<std::string> seen;
+
+    while(true){
+        bool done = std::filesystem::exists(std::filesystem::path(dir) / ".done");
+
+        std::vector<std::string> fresh;
+        for(auto& e : std::filesystem::directory_iterator(dir)){
+            std::string name = e.path().filename().string();
+            if(e.path().extension() != ".bmp" || seen.count(name) || !bmp_complete(e.path())) continue;
+            fresh.push_back(name);
+        }
+        std::sort(fresh.begin(), fresh.end(), natural_less);
+
+        for(auto& name : fresh){
+            seen.insert(name);
+            pano.add_frame((std::filesystem::path(dir) / name).c_str());
+        }
+
+        // '.done' was seen before listing, so every frame has been picked up
+        if(done) break;
+
+        if(fresh.empty()) std::this_thread::sleep_for(std::chrono::milliseconds(LIVE_POLL_MS));
+    }
+
+    pano.finish();
+}
+
+
+
+#endif // __LIVE_HPP
@@ -0,0 +1,142 @@
+// similarity metrics for x_correlate, as compile-time policies
+//
+// a metric is constructed once per pair of correlated regions. term() is summed over the
+// overlapping pixels of a shift (integers, so the kernel vectorizes), cost() turns the sum
+// into a cost (lower is better) and score() turns the best cost into a 0 ... 1 confidence
+
+#ifndef __METRIC_HPP
+#define __METRIC_HPP
+
+
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include "bmp.hpp"
+
+
+enum metric_t { METRIC_SAD, METRIC_SSD, METRIC_ZNCC };
+
+
+metric_t parse_metric(const char* name){
+    if(!strcmp(name, "sad")) return METRIC_SAD;
+    if(!strcmp(name, "ssd")) return METRIC_SSD;
+    if(!strcmp(name, "zncc")) return METRIC_ZNCC;
+
+    std::cerr << "Unknown metric \'" << name << "\' (expected sad, ssd or zncc)" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+
+
+// sum of absolute differences, same as operator * in pixel.hpp
+struct sad_metric {
+
+    sad_metric(const BMP_image&, std::pair<int, int>, std::pair<int, int>,
+               const BMP_image&, std::pair<int, int>, std::pair<int, int>) {}
+
+    static inline int64_t term(const pixel& p, const pixel& q){
+        return abs(p.r - q.r) + abs(p.g - q.g) + abs(p.b - q.b);
+    }
+
+    // sum: summed terms, then (unused here) the first overlapping column of each region
+    // and the overlap width
+    inline sim_t cost(int64_t sum, int, int, int) const {
+        return (sim_t) sum / (3*255);
+    }
+
+    // n: number of pixels in the region
+    static float score(sim_t cost, int n){
+        return cost * -1/n + 1;
+    }
+};
+
+
+
+// sum of squared differences
+struct ssd_metric {
+
+    ssd_metric(const BMP_image&, std::pair<int, int>, std::pair<int, int>,
+               const BMP_image&, std::pair<int, int>, std::pair<int, int>) {}
+
+    static inline int64_t term(const pixel& p, const pixel& q){
+        int dr = p.r - q.r, dg = p.g - q.g, db = p.b - q.b;
+        return dr*dr + dg*dg + db*db;
+    }
+
+    inline sim_t cost(int64_t sum, int, int, int) const {
+        return (sim_t) sum / (3*255*255);
+    }
+
+    static float score(sim_t cost, int n){
+        return cost * -1/n + 1;
+    }
+};
+
+
+
+// zero-mean normalized cross-correlation of pixel intensities (r+g+b), insensitive to
+// brightness and contrast changes between frames. the sums and sums of squares of each
+// region's overlap come from column prefix sums, so they cost O(1) per shift
+struct zncc_metric {
+
+    zncc_metric(const BMP_image& a, std::pair<int, int> a_start, std::pair<int, int> a_end,
+                const BMP_image& b, std::pair<int, int> b_start, std::pair<int, int> b_end)
+    : height(a_end.second - a_start.second + 1)
+    {
+        prefix(a, a_start, a_end, sa, qa);
+        prefix(b, b_start, b_end, sb, qb);
+    }
+
+    static inline int64_t term(const pixel& p, const pixel& q){
+        return (p.r + p.g + p.b) * (q.r + q.g + q.b);
+    }
+
+    // 1 - zncc, between 0 (perfect match) and 2
+    inline sim_t cost(int64_t sum, int a_off, int b_off, int len) const {
+        double n = (double) len * height;
+        double s_a = sa[a_off+len] - sa[a_off], q_a = qa[a_off+len] - qa[a_off];
+        double s_b = sb[b_off+len] - sb[b_off], q_b = qb[b_off+len] - qb[b_off];
+
+        double var_a = q_a - s_a*s_a/n;
+        double var_b = q_b - s_b*s_b/n;
+        if(var_a <= 0 || var_b <= 0) return 1;   // flat region, no information
+
+        return 1 - (sum - s_a*s_b/n) / sqrt(var_a * var_b);
+    }
+
+    static float score(sim_t cost, int){
+        return 1 - cost;
+    }
+
+private:
+
+    int                     height;
+    std::vector<int64_t>    sa, qa, sb, qb;    // prefix sums over columns of intensity and its square
+
+
+    static void prefix(const BMP_image& img, std::pair<int, int> start, std::pair<int, int> end,
+                       std::vector<int64_t>& s, std::vector<int64_t>& q)
+    {
+        int width = end.first - start.first + 1;
+        s.assign(width+1, 0);
+        q.assign(width+1, 0);
+
+        for(int j=start.second; j<=end.second; ++j){
+            const pixel* row = &img.ploc(start.first, j);
+            for(int i=0; i<width; ++i){
+                int v = row[i].r + row[i].g + row[i].b;
+                s[i+1] += v;
+                q[i+1] += v*v;
+            }
+        }
+
+        for(int i=0; i<width; ++i){
+            s[i+1] += s[i];
+            q[i+1] += q[i];
+        }
+    }
+};
+
+
+
+#endif // __METRIC_HPP
@@ -4,6 +4,19 @@
 #include <string>
 #include <sstream>
 #include <iomanip>
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <algorithm>
+
+// SIMD for the span operations, -DPIXEL_SCALAR leaves them to the plain fixed point code
+#if defined(__SSE2__) && !defined(PIXEL_SCALAR)
+#define PIXEL_SSE2
+#include <immintrin.h>
+#endif
+#if defined(__AVX2__) && !defined(PIXEL_SCALAR)
+#define PIXEL_AVX2
+#endif
 
 
 #define WHITE pixel(255, 255, 255)
@@ -243,4 +256,217 @@ inline sim_t operator * (const pixel4& p1, const pixel4& p2){
 }
 
 
+
+
+// SPAN OPERATIONS - the pixel4 operators above applied to n pixels at a time
+//
+// weights are 8.8 fixed point (256 = 1.0) instead of float, the results match the single
+// pixel operators up to 1 in each channel (exactly for weights that are multiples of 1/256).
+// alpha is kept from the left hand side, like the operators do. uses AVX2 and/or SSE2 when
+// the compiler targets them and plain fixed point code for the remaining pixels (all of
+// them with -DPIXEL_SCALAR). test/span_test.cpp checks each of these, 'make test'
+
+// float weight to 8.8 fixed point
+inline uint16_t fx_weight(float w){
+    if(!(w > 0)) return 0;
+    if(w >= 255.99f) return 0xFFFF;
+    return (uint16_t) lround(w * 256);
+}
+
+
+// c * w, saturated
+inline uint8_t fx_mul(uint8_t c, uint16_t w){
+    unsigned int v = (c * (unsigned int) w) >> 8;
+    return v > 255 ? 255 : v;
+}
+
+
+inline uint8_t fx_add(uint8_t x, uint8_t y){
+    unsigned int v = x + y;
+    return v > 255 ? 255 : v;
+}
+
+
+// a*(1-t) + b*t with t = wb/256, both products truncated like operator *
+inline pixel4 fx_lerp(const pixel4& a, const pixel4& b, uint16_t wb){
+    uint16_t wa = 256 - wb;
+    return pixel4(fx_add(fx_mul(a.r, wa), fx_mul(b.r, wb)),
+                  fx_add(fx_mul(a.g, wa), fx_mul(b.g, wb)),
+                  fx_add(fx_mul(a.b, wa), fx_mul(b.b, wb)), a.a);
+}
+
+
+#if defined(PIXEL_SSE2)
+
+// 4 pixels times weights, wlo for pixels 0 and 1, whi for pixels 2 and 3 (each repeated for
+// the 4 channels). (c << 8) * w >> 16 == c * w >> 8, then clamped to 255
+inline __m128i fx_mul_sse2(__m128i px, __m128i wlo, __m128i whi){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    __m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, px), wlo);
+    __m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, px), whi);
+    lo = _mm_sub_epi16(lo, _mm_subs_epu16(lo, max));
+    hi = _mm_sub_epi16(hi, _mm_subs_epu16(hi, max));
+    return _mm_packus_epi16(lo, hi);
+}
+
+
+// weights of 4 consecutive pixels in the layout fx_mul_sse2 expects
+inline void fx_weights_sse2(const uint16_t* w, __m128i& wlo, __m128i& whi){
+    __m128i v = _mm_loadl_epi64((const __m128i*) w);   // w0 w1 w2 w3
+    v = _mm_unpacklo_epi16(v, v);                       // w0 w0 w1 w1 w2 w2 w3 w3
+    wlo = _mm_unpacklo_epi32(v, v);                     // w0 w0 w0 w0 w1 w1 w1 w1
+    whi = _mm_unpackhi_epi32(v, v);                     // w2 w2 w2 w2 w3 w3 w3 w3
+}
+
+
+// color channels of res, alpha of a
+inline __m128i keep_alpha_sse2(__m128i res, __m128i a){
+    const __m128i rgb = _mm_set1_epi32(0x00FFFFFF);
+    return _mm_or_si128(_mm_and_si128(res, rgb), _mm_andnot_si128(rgb, a));
+}
+
+#endif
+
+
+#if defined(PIXEL_AVX2)
+
+// 8 pixel versions, unpack and pack work within 128 bit lanes so the weights are laid out
+// per lane: pixels 0 1 | 4 5 in wlo, 2 3 | 6 7 in whi
+inline __m256i fx_mul_avx2(__m256i px, __m256i wlo, __m256i whi){
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi16(255);
+    __m256i lo = _mm256_mulhi_epu16(_mm256_unpacklo_epi8(zero, px), wlo);
+    __m256i hi = _mm256_mulhi_epu16(_mm256_unpackhi_epi8(zero, px), whi);
+    lo = _mm256_min_epu16(lo, max);
+    hi = _mm256_min_epu16(hi, max);
+    return _mm256_packus_epi16(lo, hi);
+}
+
+
+inline void fx_weights_avx2(const uint16_t* w, __m256i& wlo, __m256i& whi){
+    __m128i l0, h0, l1, h1;
+    fx_weights_sse2(w, l0, h0);
+    fx_weights_sse2(w+4, l1, h1);
+    wlo = _mm256_set_m128i(l1, l0);
+    whi = _mm256_set_m128i(h1, h0);
+}
+
+
+inline __m256i keep_alpha_avx2(__m256i res, __m256i a){
+    const __m256i rgb = _mm256_set1_epi32(0x00FFFFFF);
+    return _mm256_or_si256(_mm256_and_si256(res, rgb), _mm256_andnot_si256(rgb, a));
+}
+
+#endif
+
+
+// dst[i] += src[i]
+void add_span(pixel4* dst, const pixel4* src, size_t n){
+    size_t i = 0;
+#if defined(PIXEL_AVX2)
+    const __m256i rgb8 = _mm256_set1_epi32(0x00FFFFFF);
+    for(; i+8<=n; i+=8){
+        __m256i d = _mm256_loadu_si256((const __m256i*) &dst[i]);
+        __m256i s = _mm256_loadu_si256((const __m256i*) &src[i]);
+        _mm256_storeu_si256((__m256i*) &dst[i], _mm256_adds_epu8(d, _mm256_and_si256(s, rgb8)));
+    }
+#endif
+#if defined(PIXEL_SSE2)
+    const __m128i rgb4 = _mm_set1_epi32(0x00FFFFFF);
+    for(; i+4<=n; i+=4){
+        __m128i d = _mm_loadu_si128((const __m128i*) &dst[i]);
+        __m128i s = _mm_loadu_si128((const __m128i*) &src[i]);
+        _mm_storeu_si128((__m128i*) &dst[i], _mm_adds_epu8(d, _mm_and_si128(s, rgb4)));
+    }
+#endif
+    for(; i<n; ++i) dst[i] += src[i];
+}
+
+
+// dst[i] -= src[i]
+void sub_span(pixel4* dst, const pixel4* src, size_t n){
+    size_t i = 0;
+#if defined(PIXEL_AVX2)
+    const __m256i rgb8 = _mm256_set1_epi32(0x00FFFFFF);
+    for(; i+8<=n; i+=8){
+        __m256i d = _mm256_loadu_si256((const __m256i*) &dst[i]);
+        __m256i s = _mm256_loadu_si256((const __m256i*) &src[i]);
+        _mm256_storeu_si256((__m256i*) &dst[i], _mm256_subs_epu8(d, _mm256_and_si256(s, rgb8)));
+    }
+#endif
+#if defined(PIXEL_SSE2)
+    const __m128i rgb4 = _mm_set1_epi32(0x00FFFFFF);
+    for(; i+4<=n; i+=4){
+        __m128i d = _mm_loadu_si128((const __m128i*) &dst[i]);
+        __m128i s = _mm_loadu_si128((const __m128i*) &src[i]);
+        _mm_storeu_si128((__m128i*) &dst[i], _mm_subs_epu8(d, _mm_and_si128(s, rgb4)));
+    }
+#endif
+    for(; i<n; ++i) dst[i] -= src[i];
+}
+
+
+// dst[i] *= scl
+void scale_span(pixel4* dst, float scl, size_t n){
+    uint16_t w = fx_weight(scl);
+    size_t i = 0;
+#if defined(PIXEL_AVX2)
+    const __m256i w8 = _mm256_set1_epi16(w);
+    for(; i+8<=n; i+=8){
+        __m256i d = _mm256_loadu_si256((const __m256i*) &dst[i]);
+        _mm256_storeu_si256((__m256i*) &dst[i], keep_alpha_avx2(fx_mul_avx2(d, w8, w8), d));
+    }
+#endif
+#if defined(PIXEL_SSE2)
+    const __m128i w4 = _mm_set1_epi16(w);
+    for(; i+4<=n; i+=4){
+        __m128i d = _mm_loadu_si128((const __m128i*) &dst[i]);
+        _mm_storeu_si128((__m128i*) &dst[i], keep_alpha_sse2(fx_mul_sse2(d, w4, w4), d));
+    }
+#endif
+    for(; i<n; ++i) dst[i] = pixel4(fx_mul(dst[i].r, w), fx_mul(dst[i].g, w), fx_mul(dst[i].b, w), dst[i].a);
+}
+
+
+// dst[i] = a[i]*(1-t[i]) + b[i]*t[i], t in 8.8 fixed point (0 ... 256)
+// dst may be the same span as a or b
+void lerp_span(pixel4* dst, const pixel4* a, const pixel4* b, const uint16_t* t, size_t n){
+    size_t i = 0;
+#if defined(PIXEL_AVX2)
+    const __m256i one8 = _mm256_set1_epi16(256);
+    for(; i+8<=n; i+=8){
+        __m256i wlo, whi;
+        fx_weights_avx2(&t[i], wlo, whi);
+        __m256i va = _mm256_loadu_si256((const __m256i*) &a[i]);
+        __m256i vb = _mm256_loadu_si256((const __m256i*) &b[i]);
+        __m256i r = _mm256_adds_epu8(fx_mul_avx2(va, _mm256_sub_epi16(one8, wlo), _mm256_sub_epi16(one8, whi)),
+                                     fx_mul_avx2(vb, wlo, whi));
+        _mm256_storeu_si256((__m256i*) &dst[i], keep_alpha_avx2(r, va));
+    }
+#endif
+#if defined(PIXEL_SSE2)
+    const __m128i one4 = _mm_set1_epi16(256);
+    for(; i+4<=n; i+=4){
+        __m128i wlo, whi;
+        fx_weights_sse2(&t[i], wlo, whi);
+        __m128i va = _mm_loadu_si128((const __m128i*) &a[i]);
+        __m128i vb = _mm_loadu_si128((const __m128i*) &b[i]);
+        __m128i r = _mm_adds_epu8(fx_mul_sse2(va, _mm_sub_epi16(one4, wlo), _mm_sub_epi16(one4, whi)),
+                                  fx_mul_sse2(vb, wlo, whi));
+        _mm_storeu_si128((__m128i*) &dst[i], keep_alpha_sse2(r, va));
+    }
+#endif
+    for(; i<n; ++i) dst[i] = fx_lerp(a[i], b[i], t[i]);
+}
+
+
+// same weight t (0 ... 1) for every pixel
+void lerp_span(pixel4* dst, const pixel4* a, const pixel4* b, float t, size_t n){
+    uint16_t w[64];
+    std::fill(w, w+64, std::min(fx_weight(t), (uint16_t) 256));
+    for(size_t i=0; i<n; i+=64) lerp_span(dst+i, a+i, b+i, w, std::min((size_t) 64, n-i));
+}
+
+
 #endif // __PIXEL_HPP
\ No newline at end of file
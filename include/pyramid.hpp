@@ -0,0 +1,213 @@
+// tiled multi-resolution output (deep-zoom style pyramid)
+//
+// level 0 is the full image, every next level is half the width and height of the
+// previous one (2x2 box filter), down to the first level that fits into a single tile.
+// each level is cut into PYRAMID_TILE x PYRAMID_TILE tiles (smaller at the right and
+// bottom edges) stored as <out_dir>/<level>/<col>_<row>.bmp, so a viewer only loads
+// the tiles it shows.
+//
+// rows are streamed in top to bottom: every level keeps one row of tiles and one pending
+// row, two rows of a level make one row of the next, so the whole image is never in memory
+// and is read only once
+//
+// manifest <out_dir>/pyramid.txt: tile_size \n n_levels \n then per level: width height cols rows \n
+// out_dir must be empty or hold an earlier pyramid, only the files of that one are replaced
+
+#ifndef __PYRAMID_HPP
+#define __PYRAMID_HPP
+
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <cstdio>
+#include <algorithm>
+#include <filesystem>
+#include "util.hpp"
+
+
+#define PYRAMID_TILE 256
+
+
+struct pyramid_writer {
+
+    pyramid_writer(const char* out_dir, unsigned int width, unsigned int height, unsigned int tile = PYRAMID_TILE)
+    : out_dir(out_dir), tile(tile)
+    {
+        clear_old();
+
+        while(true){
+            levels.push_back({ width, height });
+            std::filesystem::create_directories(this->out_dir / std::to_string(levels.size()-1));
+            if(width <= tile && height <= tile) break;
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+        }
+
+        for(auto& l : levels) l.rows.resize(l.width * std::min(tile, l.height));
+    }
+
+
+    // appends all rows of band to level 0, like BMP_writer::write_rows
+    void write_rows(const BMP_image& band){
+        if(band.info_h.width != levels[0].width || levels[0].n_in + band.info_h.height > levels[0].height){
+            throw std::runtime_error("Band of size " + std::to_string(band.info_h.width) + "x" + std::to_string(band.info_h.height)
+                                    + " does not fit into pyramid '" + out_dir.string() + "'");
+        }
+        for(int j=0; j<band.info_h.height; ++j) push_row(0, &band.data[j * band.info_h.width]);
+    }
+
+
+    // flushes the last rows of every level and writes the manifest
+    void finish(){
+        if(levels[0].n_in != levels[0].height){
+            throw std::runtime_error("Pyramid '" + out_dir.string() + "' finished after " + std::to_string(levels[0].n_in)
+                                    + " of " + std::to_string(levels[0].height) + " rows");
+        }
+
+        // a level with an odd height still holds its last row, it is paired with itself
+        for(int k=0; k+1<levels.size(); ++k){
+            if(levels[k].n_in % 2) push_row(k+1, downsample(levels[k], levels[k].pending.data(), levels[k].pending.data()));
+        }
+
+        std::ofstream out(out_dir / "pyramid.txt");
+        if(!out){
+            // error opening file
+            throw std::runtime_error("Unable to write to file '" + (out_dir / "pyramid.txt").string() + "'");
+        }
+        out << tile << std::endl;
+        out << levels.size() << std::endl;
+        for(auto& l : levels){
+            out << l.width << " " << l.height << " " << (l.width + tile-1) / tile << " " << (l.height + tile-1) / tile << std::endl;
+        }
+    }
+
+
+private:
+
+    struct level {
+        unsigned int          width;
+        unsigned int          height;
+        unsigned int          n_in      = 0;     // rows received so far
+        std::vector<pixel>    rows;              // current row of tiles
+        std::vector<pixel>    pending;           // even row waiting for its pair
+        std::vector<pixel>    down;              // downsampled row for the next level
+    };
+
+    std::filesystem::path    out_dir;
+    unsigned int             tile;
+    std::vector<level>       levels;
+
+
+    // out_dir must be empty or hold a pyramid written before, which is replaced: its manifest
+    // and the tiles of the levels it names. nothing else in out_dir is touched
+    void clear_old(){
+        std::error_code ec;
+        if(std::filesystem::is_empty(out_dir, ec) || ec) return;
+
+        std::ifstream in(out_dir / "pyramid.txt");
+        unsigned int old_tile = 0, n_levels = 0;
+        if(!(in >> old_tile >> n_levels)){
+            throw std::runtime_error("Directory '" + out_dir.string() + "' is not empty and holds no pyramid");
+        }
+        in.close();
+
+        for(unsigned int k=0; k<n_levels; ++k){
+            std::filesystem::path dir = out_dir / std::to_string(k);
+            for(auto& e : std::filesystem::directory_iterator(dir, ec)){
+                std::string n = e.path().filename().string();
+                unsigned int c, r;
+                if(sscanf(n.c_str(), "%u_%u", &c, &r) == 2 && n == std::to_string(c) + "_" + std::to_string(r) + ".bmp"){
+                    std::filesystem::remove(e.path(), ec);
+                }
+            }
+            std::filesystem::remove(dir, ec);    // only if nothing else was in there
+        }
+        std::filesystem::remove(out_dir / "pyramid.txt", ec);
+    }
+
+
+    void push_row(int k, const pixel* row){
+        level& l = levels[k];
+
+        unsigned int in_tile = l.n_in % tile;
+        std::copy(row, row + l.width, &l.rows[in_tile * l.width]);
+        ++l.n_in;
+
+        if(in_tile + 1 == tile || l.n_in == l.height) write_tiles(k, in_tile + 1);
+
+        if(k+1 == levels.size()) return;
+
+        if(l.n_in % 2) l.pending.assign(row, row + l.width);
+        else push_row(k+1, downsample(l, l.pending.data(), row));
+    }
+
+
+    // averages 2x2 blocks of rows a and b, an odd last column is paired with itself
+    const pixel* downsample(level& l, const pixel* a, const pixel* b){
+        unsigned int w = (l.width + 1) / 2;
+        l.down.resize(w);
+
+        for(int i=0; i<w; ++i){
+            int i0 = 2*i, i1 = std::min(2*i + 1, (int) l.width - 1);
+            pixel& d = l.down[i];
+            d.b = (a[i0].b + a[i1].b + b[i0].b + b[i1].b + 2) / 4;
+            d.g = (a[i0].g + a[i1].g + b[i0].g + b[i1].g + 2) / 4;
+            d.r = (a[i0].r + a[i1].r + b[i0].r + b[i1].r + 2) / 4;
+            d.a = (a[i0].a + a[i1].a + b[i0].a + b[i1].a + 2) / 4;
+        }
+
+        return l.down.data();
+    }
+
+
+    // writes the current row of tiles of level k, n rows high
+    void write_tiles(int k, unsigned int n){
+        level& l = levels[k];
+        unsigned int tile_row = (l.n_in - 1) / tile;
+
+        for(unsigned int c0=0; c0<l.width; c0+=tile){
+            unsigned int w = std::min(tile, l.width - c0);
+            BMP_image t(w, n);
+            for(int j=0; j<n; ++j) std::copy(&l.rows[j * l.width + c0], &l.rows[j * l.width + c0 + w], &t(0, j));
+
+            std::string name = std::to_string(c0 / tile) + "_" + std::to_string(tile_row) + ".bmp";
+            t.save_as((out_dir / std::to_string(k) / name).c_str());
+        }
+    }
+
+};
+
+
+
+// merges images like op_merge, but into a tile pyramid in out_dir,
+// reading PYRAMID_TILE rows of every image at a time
+void op_pyramid(const char* out_dir, const std::vector<const char*>& img_files){
+    std::deque<BMP_reader> open;      // owned here, so nothing leaks if one of them throws
+    std::vector<BMP_reader*> readers;
+    unsigned int width = 0;
+
+    for(auto f : img_files){
+        open.emplace_back(f);
+        readers.push_back(&open.back());
+        width += readers.back()->info_h.width;
+
+        if(readers.back()->info_h.height != readers[0]->info_h.height){
+            throw std::runtime_error("Image '" + std::string(f) + "' has height " + std::to_string(readers.back()->info_h.height)
+                                    + ", expected " + std::to_string(readers[0]->info_h.height));
+        }
+    }
+
+    unsigned int height = readers[0]->info_h.height;
+    pyramid_writer pyramid(out_dir, width, height);
+
+    for(unsigned int r0=0; r0<height; r0+=PYRAMID_TILE){
+        pyramid.write_rows(merge_rows(readers, r0, std::min((unsigned int) PYRAMID_TILE, height - r0)));
+    }
+
+    pyramid.finish();
+}
+
+
+
+#endif // __PYRAMID_HPP
@@ -0,0 +1,379 @@
+// long-running job server over a unix domain socket
+//
+// a client connects, sends one job as a single line of space separated words
+// (same arguments as the command line options, without the leading '--')
+// and gets a single line back: "ok <latency_ms>" or "error <message>"
+// 'stats' and 'shutdown' are answered as soon as they arrive, other jobs wait for one of
+// max_jobs job slots. correlation runs on the process wide correlate_pool() (util.hpp)
+//
+// the accept loop polls the listening socket and the connections still sending their job,
+// so a slow client holds up nobody else. file names in jobs are used as they are, relative
+// ones resolve against the server's working directory (--submit makes them absolute)
+
+#ifndef __SERVER_HPP
+#define __SERVER_HPP
+
+
+#include <string>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <cerrno>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "util.hpp"
+
+
+#define MAX_JOB_LINE         65536
+#define JOB_READ_TIMEOUT_MS  1000     // a client has this long in total to send its job after connecting
+#define MAX_QUEUED_JOBS      256      // jobs waiting for a slot (each holds a connection), more are turned away
+#define ACCEPT_RETRY_MS      100      // pause before accepting again when out of file descriptors
+
+
+// reads a single '\n' terminated line from fd
+bool read_line(int fd, std::string& line){
+    char c;
+    line.clear();
+    while(line.size() < MAX_JOB_LINE){
+        if(read(fd, &c, 1) != 1) return false;
+        if(c == '\n') return true;
+        line += c;
+    }
+    return false;
+}
+
+
+// a client that went away must not kill the server, so no SIGPIPE
+void write_line(int fd, const std::string& line){
+    std::string l = line + "\n";
+    size_t done = 0;
+    while(done < l.size()){
+        ssize_t n = send(fd, l.data() + done, l.size() - done, MSG_NOSIGNAL);
+        if(n <= 0) return;
+        done += n;
+    }
+}
+
+
+std::vector<std::string> split_words(const std::string& line){
+    std::vector<std::string> words;
+    std::stringstream ss(line);
+    std::string w;
+    while(ss >> w) words.push_back(w);
+    return words;
+}
+
+
+// fills addr with socket path, exits if the path does not fit
+void make_addr(const char* socket_path, sockaddr_un& addr){
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(addr.sun_path)){
+        std::cerr << "Socket path \'" << socket_path << "\' is too long" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, socket_path);
+}
+
+
+
+struct job_server {
+
+    job_server(const char* socket_path, unsigned int max_jobs, unsigned int resolution)
+    : socket_path(socket_path), max_jobs(std::max(1u, max_jobs)), resolution(resolution) {}
+
+
+    // listens on the socket and runs jobs until a shutdown job arrives
+    void serve(){
+        sockaddr_un addr;
+        make_addr(socket_path.c_str(), addr);
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(socket_path.c_str());
+
+        if(listen_fd < 0 || bind(listen_fd, (sockaddr*) &addr, sizeof addr) < 0 || listen(listen_fd, 64) < 0){
+            std::cerr << "Unable to listen on socket \'" << socket_path << "\'" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        std::cout << "[*] serving on '" << socket_path << "' with " << max_jobs << " job slots" << std::endl;
+
+        // workers stay alive for the whole lifetime of the server
+        std::vector<std::thread> workers;
+        for(int i=0; i<max_jobs; ++i) workers.emplace_back(&job_server::worker, this);
+
+        using clock = std::chrono::steady_clock;
+
+        std::vector<client> clients;        // connections still sending their job
+        auto accept_after = clock::now();   // accepting is paused while out of file descriptors
+        bool shutdown = false;
+
+        while(!shutdown){
+            auto now = clock::now();
+            bool accepting = now >= accept_after;
+
+            // sleep until something arrives or the next deadline passes
+            std::vector<pollfd> fds{ { listen_fd, (short) (accepting ? POLLIN : 0), 0 } };
+            int timeout = -1;
+            auto wake_at = [&](clock::time_point t){
+                int ms = std::max(0, (int) std::chrono::ceil<std::chrono::milliseconds>(t - now).count());
+                timeout = timeout < 0 ? ms : std::min(timeout, ms);
+            };
+            if(!accepting) wake_at(accept_after);
+            for(auto& c : clients){
+                fds.push_back({ c.fd, POLLIN, 0 });
+                wake_at(c.deadline);
+            }
+
+            if(poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) break;
+            now = clock::now();
+
+            // read what the clients sent, a complete line is their job
+            for(int i=clients.size()-1; i>=0; --i){
+                client& c = clients[i];
+                bool drop = false;
+
+                if(fds[i+1].revents){
+                    char buf[4096];
+                    ssize_t n = recv(c.fd, buf, sizeof buf, MSG_DONTWAIT);
+                    if(n > 0) c.line.append(buf, n);
+                    else if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) drop = true;
+                }
+
+                size_t eol = c.line.find('\n');
+                if(eol != std::string::npos){
+                    shutdown = shutdown || dispatch(c.fd, split_words(c.line.substr(0, eol)));
+                }
+                else if(drop || c.line.size() >= MAX_JOB_LINE || now >= c.deadline){
+                    close(c.fd);
+                }
+                else continue;
+
+                clients.erase(clients.begin() + i);
+            }
+
+            if(!(fds[0].revents & POLLIN) || shutdown) continue;
+
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if(fd < 0){
+                if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM){
+                    std::cerr << "Out of file descriptors, not accepting for " << ACCEPT_RETRY_MS << " ms" << std::endl;
+                    accept_after = now + std::chrono::milliseconds(ACCEPT_RETRY_MS);
+                }
+                else if(errno != EINTR && errno != ECONNABORTED && errno != EAGAIN && errno != EPROTO){
+                    std::cerr << "Unable to accept on socket \'" << socket_path << "\': " << strerror(errno) << std::endl;
+                    break;
+                }
+                continue;
+            }
+
+            if(clients.size() >= MAX_QUEUED_JOBS){
+                write_line(fd, "error server busy");
+                close(fd);
+                continue;
+            }
+            clients.push_back({ fd, "", now + std::chrono::milliseconds(JOB_READ_TIMEOUT_MS) });
+        }
+
+        for(auto& c : clients) close(c.fd);
+
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            stopping = true;
+            cv.notify_all();
+        }
+        for(auto& w : workers) w.join();
+
+        close(listen_fd);
+        unlink(socket_path.c_str());
+
+        std::cout << "[.] " << stats() << std::endl;
+    }
+
+
+private:
+
+    std::string               socket_path;
+    unsigned int              max_jobs;
+    unsigned int              resolution;
+    int                       listen_fd  = -1;
+
+    // a connection whose job line isn't complete yet
+    struct client {
+        int                                      fd;
+        std::string                              line;
+        std::chrono::steady_clock::time_point    deadline;
+    };
+
+    std::mutex                mtx;
+    std::condition_variable   cv;
+    std::deque<std::pair<int, std::vector<std::string>>>
+                              queue;               // connections and their jobs waiting for a job slot
+    bool                      stopping   = false;
+
+    // statistics, guarded by mtx
+    unsigned int              running    = 0;
+    unsigned long             n_done     = 0;
+    unsigned long             n_failed   = 0;
+    double                    total_ms   = 0;
+    double                    max_ms     = 0;
+
+
+    // control jobs (stats, shutdown) are answered right away, so they don't wait for a job
+    // slot when all of them are busy, other jobs are queued. returns true on shutdown
+    bool dispatch(int fd, std::vector<std::string> job){
+        if(job.size() == 1 && job[0] == "stats"){
+            write_line(fd, "ok " + stats());
+            close(fd);
+            return false;
+        }
+        if(job.size() == 1 && job[0] == "shutdown"){
+            write_line(fd, "ok");
+            close(fd);
+            return true;
+        }
+
+        std::unique_lock<std::mutex> lk(mtx);
+        if(queue.size() >= MAX_QUEUED_JOBS){
+            lk.unlock();
+            write_line(fd, "error server busy");
+            close(fd);
+            return false;
+        }
+        queue.push_back({ fd, std::move(job) });
+        cv.notify_one();
+        return false;
+    }
+
+
+    void worker(){
+        while(true){
+            int fd;
+            std::vector<std::string> job;
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                cv.wait(lk, [this]{ return stopping || !queue.empty(); });
+                if(queue.empty()) return;
+                fd = queue.front().first;
+                job = std::move(queue.front().second);
+                queue.pop_front();
+                ++running;
+            }
+
+            write_line(fd, handle(job));
+            close(fd);
+
+            std::lock_guard<std::mutex> lk(mtx);
+            --running;
+        }
+    }
+
+
+    std::string stats(){
+        std::stringstream ss;
+        std::lock_guard<std::mutex> lk(mtx);
+        ss << "queued=" << queue.size() << " running=" << running
+           << " done=" << n_done << " failed=" << n_failed
+           << " avg_ms=" << (n_done ? total_ms / n_done : 0) << " max_ms=" << max_ms;
+        return ss.str();
+    }
+
+
+    // runs a job and returns the reply line
+    std::string handle(const std::vector<std::string>& job){
+        if(job.empty()) return "error empty job";
+
+        auto start = std::chrono::steady_clock::now();
+
+        std::string err = run(job);
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::lock_guard<std::mutex> lk(mtx);
+        if(!err.empty()){
+            ++n_failed;
+            return "error " + err;
+        }
+        ++n_done;
+        total_ms += ms;
+        max_ms = std::max(max_ms, ms);
+        return "ok " + std::to_string(ms);
+    }
+
+
+    // returns an empty string on success, error message otherwise
+    std::string run(const std::vector<std::string>& job){
+        const std::string& op = job[0];
+        auto arg = [&job](int i){ return job[i].c_str(); };
+
+        // file and format errors in the image code are thrown and become the reply
+        try{
+            if(op == "psf" && (job.size() == 4 || job.size() == 5)){
+                op_psf(arg(1), arg(2), arg(3), resolution, job.size() == 5 ? std::stoi(job[4]) : 0);
+            }
+            else if(op == "scale" && (job.size() == 4 || job.size() == 5)){
+                op_scale(arg(1), arg(2), arg(3), job.size() == 5 ? std::stoi(job[4]) : 0);
+            }
+            else if(op == "merge" && job.size() >= 3){
+                std::vector<const char*> imgs;
+                for(int i=2; i<job.size(); ++i) imgs.push_back(arg(i));
+                op_merge(arg(1), imgs);
+            }
+            else if(op == "pipeline" && (job.size() == 4 || job.size() == 5)){
+                op_pipeline(arg(1), arg(2), arg(3), resolution, job.size() == 5 ? std::stoi(job[4]) : 0);
+            }
+            else{
+                return "unknown job or wrong number of arguments: '" + op + "'";
+            }
+        }
+        catch(const std::exception& e){
+            return e.what();
+        }
+
+        return "";
+    }
+
+};
+
+
+
+// sends a job to the server at socket_path and prints the reply, file names are made
+// absolute first, the server may run in another directory. returns true if the job succeeded
+bool submit_job(const char* socket_path, std::vector<std::string> job){
+    sockaddr_un addr;
+    make_addr(socket_path, addr);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (sockaddr*) &addr, sizeof addr) < 0){
+        std::cerr << "Unable to connect to socket \'" << socket_path << "\'" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // every argument of merge is a file, the others have an optional band_rows after three files
+    for(int i=1; i<job.size(); ++i){
+        if(i <= 3 || job[0] == "merge") job[i] = std::filesystem::absolute(job[i]).string();
+    }
+
+    std::string line;
+    for(auto& w : job) line += (line.empty() ? "" : " ") + w;
+    write_line(fd, line);
+
+    std::string reply;
+    read_line(fd, reply);
+    close(fd);
+
+    std::cout << reply << std::endl;
+
+    return reply.rfind("ok", 0) == 0;
+}
+
+
+
+#endif // __SERVER_HPP
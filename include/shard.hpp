@@ -0,0 +1,294 @@
+// multi-process psf computation over a shared queue directory
+//
+// the coordinator writes one shard file per (frame i, frame i+1) pair into <queue>/todo.
+// workers (any number, any process) claim a shard by renaming it into <queue>/claimed,
+// which is atomic so only one of them wins, keep the claim's modification time fresh
+// while working (the lease) and rename it into <queue>/done when the psf file is written.
+// claims whose lease expired (crashed worker) are put back into todo by the coordinator,
+// with an increased attempt number, and the worker's temporary psf file is removed. a lease
+// expires when the claim's modification time hasn't changed for lease_s seconds of the
+// coordinator's clock, so the machines' clocks don't have to agree. shards that failed SHARD_MAX_ATTEMPTS times go to
+// <queue>/failed. once every shard is done or failed the coordinator creates
+// <queue>/closed and the workers exit
+//
+// shard names are <index>.<attempt>, claims <index>.<attempt>.<worker>
+
+#ifndef __SHARD_HPP
+#define __SHARD_HPP
+
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <unistd.h>
+#include "util.hpp"
+
+
+#define SHARD_MAX_ATTEMPTS   3
+#define SHARD_POLL_MS        100
+
+
+namespace fs = std::filesystem;
+
+
+// psf options carried by every shard
+struct shard_options {
+    unsigned int   band_rows    = 0;
+    unsigned int   sparse_step  = 0;
+    int            bg_tol       = -1;
+    metric_t       metric       = METRIC_SAD;
+};
+
+
+// splits "<index>.<attempt>[.<worker>]"
+void parse_shard_name(const std::string& name, int* index, int* attempt){
+    *index = atoi(name.c_str());
+    *attempt = atoi(name.c_str() + name.find('.') + 1);
+}
+
+
+// <host>-<pid>, unique among the processes sharing a queue on several machines
+std::string worker_id(){
+    char host[256] = "localhost";
+    gethostname(host, sizeof host - 1);
+    return std::string(host) + "-" + std::to_string(getpid());
+}
+
+
+// writes a file under a temporary name and renames it into place, so readers never see it half written
+void write_atomic(const fs::path& p, const std::string& content){
+    fs::path tmp = p.string() + ".tmp" + worker_id();
+    std::ofstream(tmp) << content;
+    fs::rename(tmp, p);
+}
+
+
+std::vector<std::string> list_dir(const fs::path& dir){
+    std::vector<std::string> names;
+    std::error_code ec;
+    for(auto& e : fs::directory_iterator(dir, ec)){
+        std::string n = e.path().filename().string();
+        if(n.find(".tmp") == std::string::npos) names.push_back(n);
+    }
+    return names;
+}
+
+
+
+// splits the psf computation of all frames in img_dir into shards and waits until workers
+// have processed them. returns false if some shards failed
+bool coordinate_psf(const char* img_dir, const char* psf_dir, const char* queue_dir, int lease_s, const shard_options& opt){
+    fs::path q(queue_dir);
+    auto frames = list_frames(img_dir);
+    int n = frames.size();
+
+    if(n < 2){
+        throw std::runtime_error("Need at least 2 frames in '" + std::string(img_dir) + "' (got " + std::to_string(n) + ")");
+    }
+    if(lease_s <= 0){
+        throw std::runtime_error("Lease of " + std::to_string(lease_s) + " s, it must be at least 1 s");
+    }
+
+    // only the queue's own entries are cleared, queue_dir may hold other files
+    for(auto d : { "todo", "claimed", "done", "failed" }){
+        fs::remove_all(q / d);
+        fs::create_directories(q / d);
+    }
+    fs::remove(q / "lease");
+    fs::remove(q / "closed");
+    fs::create_directories(psf_dir);
+
+    write_atomic(q / "lease", std::to_string(lease_s) + "\n");
+
+    // last frame pairs with the first one, like run.sh. paths are absolute, workers may
+    // run in another directory
+    std::vector<std::string> outs;
+    for(int i=0; i<n; ++i){
+        outs.push_back((fs::absolute(psf_dir) / (fs::path(frames[i]).filename().string() + ".psf")).string());
+        std::stringstream ss;
+        ss << fs::absolute(frames[i]).string() << "\n" << fs::absolute(frames[(i+1) % n]).string() << "\n" << outs[i] << "\n"
+           << opt.band_rows << " " << opt.sparse_step << " " << opt.bg_tol << " " << (int) opt.metric << "\n";
+        write_atomic(q / "todo" / (std::to_string(i) + ".0"), ss.str());
+    }
+
+    std::cout << "[*] " << n << " shards queued in '" << queue_dir << "'" << std::endl;
+
+    int n_done = 0, n_failed = 0, n_retried = 0;
+
+    // last modification time seen for each claim and when it was first seen (our clock)
+    std::map<std::string, std::pair<fs::file_time_type, std::chrono::steady_clock::time_point>> seen;
+
+    while(true){
+        auto now = std::chrono::steady_clock::now();
+
+        // expired leases go back to the queue
+        auto claims = list_dir(q / "claimed");
+        for(auto it=seen.begin(); it!=seen.end(); ){
+            if(std::find(claims.begin(), claims.end(), it->first) == claims.end()) it = seen.erase(it);
+            else ++it;
+        }
+
+        for(auto& c : claims){
+            std::error_code ec;
+            auto t = fs::last_write_time(q / "claimed" / c, ec);
+            if(ec) continue;
+
+            auto it = seen.find(c);
+            if(it == seen.end() || it->second.first != t){
+                seen[c] = { t, now };
+                continue;
+            }
+            if(now - it->second.second < std::chrono::seconds(lease_s)) continue;
+
+            int index, attempt;
+            parse_shard_name(c, &index, &attempt);
+            fs::rename(q / "claimed" / c, q / "todo" / (std::to_string(index) + "." + std::to_string(attempt+1)), ec);
+            if(!ec){
+                ++n_retried;
+                seen.erase(c);
+                std::cout << std::endl << "[!] lease of shard " << index << " expired (" << c << "), retrying" << std::endl;
+
+                // the psf file the worker was writing, named like in work_psf
+                std::string worker = c.substr(c.find('.', c.find('.') + 1) + 1);
+                fs::remove(outs[index] + ".tmp" + worker, ec);
+            }
+        }
+
+        // shards that keep failing are given up on
+        for(auto& t : list_dir(q / "todo")){
+            int index, attempt;
+            parse_shard_name(t, &index, &attempt);
+            if(attempt < SHARD_MAX_ATTEMPTS) continue;
+
+            std::error_code ec;
+            fs::rename(q / "todo" / t, q / "failed" / t, ec);
+            if(!ec) std::cerr << "Shard " << index << " failed " << attempt << " times, giving up" << std::endl;
+        }
+
+        n_done = list_dir(q / "done").size();
+        n_failed = list_dir(q / "failed").size();
+
+        std::cout << "\rShards: " << n_done << "/" << n << std::flush;
+
+        if(n_done + n_failed >= n) break;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(SHARD_POLL_MS));
+    }
+
+    write_atomic(q / "closed", "");
+
+    // temporary psf files of workers that died after their lease had already expired
+    std::error_code ec;
+    for(auto& e : fs::directory_iterator(fs::absolute(psf_dir), ec)){
+        std::string name = e.path().string();
+        for(auto& o : outs){
+            if(name.size() > o.size() + 4 && !name.compare(0, o.size() + 4, o + ".tmp")){
+                fs::remove(e.path(), ec);
+                break;
+            }
+        }
+    }
+
+    std::cout << std::endl << "[.] " << n_done << " done, " << n_failed << " failed, " << n_retried << " retried" << std::endl;
+
+    return n_failed == 0;
+}
+
+
+
+// claims and processes shards from queue_dir until the coordinator closes the queue
+void work_psf(const char* queue_dir, unsigned int resolution){
+    fs::path q(queue_dir);
+
+    // wait for the coordinator to set up the queue
+    while(!fs::exists(q / "lease")) std::this_thread::sleep_for(std::chrono::milliseconds(SHARD_POLL_MS));
+
+    int lease_s = 0;
+    std::ifstream(q / "lease") >> lease_s;
+    if(lease_s <= 0){
+        throw std::runtime_error("Queue '" + std::string(queue_dir) + "' has no valid lease time");
+    }
+
+    std::string worker = worker_id();
+
+    int n_processed = 0;
+
+    while(!fs::exists(q / "closed")){
+        // try the queued shards until one claim succeeds
+        fs::path claim;
+        std::string shard;
+        for(auto& t : list_dir(q / "todo")){
+            std::error_code ec;
+            fs::path c = q / "claimed" / (t + "." + worker);
+            fs::rename(q / "todo" / t, c, ec);
+            if(!ec){
+                claim = c;
+                shard = t;
+                break;
+            }
+        }
+
+        if(claim.empty()){
+            std::this_thread::sleep_for(std::chrono::milliseconds(SHARD_POLL_MS));
+            continue;
+        }
+
+        int index, attempt;
+        parse_shard_name(shard, &index, &attempt);
+
+        std::string img1, img2, out;
+        shard_options opt;
+        int metric;
+        std::ifstream in(claim);
+        std::getline(in, img1);
+        std::getline(in, img2);
+        std::getline(in, out);
+        in >> opt.band_rows >> opt.sparse_step >> opt.bg_tol >> metric;
+        opt.metric = (metric_t) metric;
+        in.close();
+
+        // renew the lease while working
+        std::atomic<bool> working{true};
+        std::thread heartbeat([&]{
+            auto period = std::chrono::milliseconds(lease_s * 1000 / 3);
+            while(working){
+                std::error_code ec;
+                fs::last_write_time(claim, fs::file_time_type::clock::now(), ec);
+                for(auto t = std::chrono::milliseconds(0); working && t < period; t += std::chrono::milliseconds(SHARD_POLL_MS))
+                    std::this_thread::sleep_for(std::chrono::milliseconds(SHARD_POLL_MS));
+            }
+        });
+
+        bool ok = true;
+        try{
+            // the psf file is written under a temporary name, a retried shard never sees half a file
+            std::string tmp = out + ".tmp" + worker;
+            op_psf(img1.c_str(), img2.c_str(), tmp.c_str(), resolution, opt.band_rows, opt.sparse_step, opt.bg_tol, opt.metric);
+            fs::rename(tmp, out);
+        }
+        catch(const std::exception& e){
+            std::cerr << "Shard " << index << " failed: " << e.what() << std::endl;
+            ok = false;
+        }
+
+        working = false;
+        heartbeat.join();
+
+        // if the lease expired in the meantime the rename fails, the result is the same either way
+        std::error_code ec;
+        if(ok) fs::rename(claim, q / "done" / std::to_string(index), ec);
+        else fs::rename(claim, q / "todo" / (std::to_string(index) + "." + std::to_string(attempt+1)), ec);
+
+        if(ok) ++n_processed;
+    }
+
+    std::cout << "[.] worker " << worker << " processed " << n_processed << " shards" << std::endl;
+}
+
+
+
+#endif // __SHARD_HPP
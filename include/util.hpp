@@ -5,7 +5,16 @@
 
 
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 #include "bmp.hpp"
+#include "metric.hpp"
 
 
 // HALP
@@ -24,9 +33,64 @@ Possible options:
     --scale <img> <psf_file> <out_img>      :  scale image according to its
                                                corresponding psf profile in psf_file and cuts
                                                a strip of given width from their center
+
+    --psf and --scale accept a trailing '--band <rows>' to process <rows> rows at a time
+    instead of loading whole images (memory stays constant in the image height)
+
+    --psf accepts a trailing '--sparse <step>' to correlate only every <step>-th strip
+    (and strips where the interpolated shift is off), interpolating the rest
+
+    --psf accepts a trailing '--mask <tol>' to skip background against background comparisons
+    in each strip, pixels within <tol> (0-255) of the background color are background, strips
+    without foreground take the shift of their neighbours
+
+    --psf accepts a trailing '--metric <sad|ssd|zncc>' to pick the similarity metric (default sad),
+    zncc is insensitive to lighting changes between frames. it compares only the foreground, with
+    '--mask 16' unless another '--mask' is given
+
+    --psf and --scale accept a trailing '--journal <file>' to record finished outputs in a checkpoint
+    journal. an output that the journal says is intact and made from the same inputs is not redone
+    other operations accept none of these trailing options
     
     --merge <out_img> <img_1> ... <img_N>   :  merge images from left to right in given order
                                                and saves the result with name <out_img>
+
+    images can be read from and written to '.flz' files, a compressed format for intermediate
+    results (mostly flat strips): --scale <img> <psf_file> strip.flz, then --merge out.bmp *.flz
+
+    --pyramid <out_dir> <img_1> ... <img_N> :  like --merge, but writes a tile pyramid to <out_dir>: 256x256 tiles
+                                               <level>/<col>_<row>.bmp, level 0 at full size and every next
+                                               level at half the size, plus the manifest pyramid.txt
+
+    --live <out_img> [<frame_dir>]          :  build the panorama while frames are captured: frame file names
+                                               are read from stdin, or picked up from <frame_dir> as they appear
+                                               until a file named '.done' is created there
+                                               finished strips appear in <out_img>.strips/ (listed in index.txt)
+                                               one frame after capture, <out_img> itself is assembled from
+                                               them when the capture ends, a pass over the whole panorama
+
+    --batch <ram_mib> <img_dir_1> <out_img_1> [<img_dir_2> <out_img_2> ...]
+                                            :  process many scans in one process, frame by frame, keeping
+                                               the estimated memory in use under <ram_mib> MiB
+
+    --coordinate <img_dir> <psf_dir> <queue_dir> [<lease_s>]
+                                            :  like run.sh -p, but split into shards in <queue_dir> that any
+                                               number of --work processes pick up. a shard whose worker
+                                               stops renewing it for <lease_s> (default 30) seconds is retried
+                                               (accepts the trailing options of --psf except --journal)
+
+    --work <queue_dir>                      :  process shards from <queue_dir> until the coordinator is done
+
+    --serve <socket> [<max_jobs>]           :  run as a job server listening on unix socket <socket>,
+                                               running at most <max_jobs> (default 4) jobs at a time
+
+    --submit <socket> <job> [<args>...]     :  send a job to the server and wait for the result
+                                               jobs: psf <img1> <img2> <psf_file> [<band_rows>]
+                                                     scale <img> <psf_file> <out_img> [<band_rows>]
+                                                     merge <out_img> <img_1> ... <img_N>
+                                                     pipeline <img1> <img2> <out_img> [<band_rows>]
+                                                     stats
+                                                     shutdown
     
     --help                                  :  display this help text
     )" << std::endl;
@@ -36,9 +100,11 @@ Possible options:
 
 // correlate two regions considering translation in x axis only
 // stores number of pixels shifted (positive direction: left) and activation in res
+// columns are relative to the start of each region, Metric is one of metric.hpp
+template<typename Metric>
 void x_correlate_region(const BMP_image& a, std::pair<int, int> a_start, std::pair<int, int> a_end,
                         const BMP_image& b, std::pair<int, int> b_start, std::pair<int, int> b_end,
-                        int sh_start, int sh_end, int sh_begin, sim_t* act)
+                        int sh_start, int sh_end, int sh_begin, sim_t* act, const Metric& metric)
 {
     // heights are different
     if(abs(a_start.second - a_end.second)+1 != abs(b_start.second - b_end.second)+1){
@@ -56,46 +122,136 @@ void x_correlate_region(const BMP_image& a, std::pair<int, int> a_start, std::pa
         throw std::runtime_error("Width of b is greater than width of a. Swap the arguments maybe");
     }
 
-    // activations initialized to 0
-    for(int i=sh_start; i<sh_end; ++i) act[i - sh_begin] = 0;
-
-    // outer loop with j for cache efficiency
-
     for(int shift=sh_start; shift<sh_end; ++shift){
+        int a_off, b_off, len;    // overlapping columns of a and b
+
         // b entering a
         if(shift <= 0){
-            for(int j=a_start.second; j<a_start.second+height; ++j){
-                for(int i=0; i<width_b+shift; ++i){
-                    act[shift - sh_begin] += a.ploc(i, j) * b.ploc(i-shift, j);
-                }
-            }
+            a_off = 0;
+            b_off = -shift;
+            len = width_b + shift;
         }
         // b fully inside a
         else if ((width_a - shift) >= width_b){
-            for(int j=a_start.second; j<a_start.second+height; ++j){
-                for(int i=0; i<width_b; ++i){
-                    act[shift - sh_begin] += a.ploc(i+shift, j) * b.ploc(i, j);
-                }
-            }
+            a_off = shift;
+            b_off = 0;
+            len = width_b;
         }
         // b leaving a
         else{
-            for(int j=a_start.second; j<a_start.second+height; ++j){
-                for(int i=0; i<width_a-shift; ++i){
-                    act[shift - sh_begin] += a.ploc(i+shift, j) * b.ploc(i, j);
-                }
+            a_off = shift;
+            b_off = 0;
+            len = width_a - shift;
+        }
+
+        // outer loop with j for cache efficiency, rows are contiguous so the inner loop vectorizes
+        int64_t sum = 0;
+        if(len > 0){
+            for(int j=0; j<height; ++j){
+                const pixel* pa = &a.ploc(a_start.first + a_off, a_start.second + j);
+                const pixel* pb = &b.ploc(b_start.first + b_off, b_start.second + j);
+                for(int i=0; i<len; ++i) sum += Metric::term(pa[i], pb[i]);
+            }
+        }
+
+        act[shift - sh_begin] = metric.cost(sum, a_off, b_off, len);
+    }
+}
+
+
+
+// threads started once and shared by every x_correlate call in the process, so the job
+// server and batch mode don't start and join threads for every strip of every job
+struct worker_pool {
+
+    worker_pool(unsigned int n_threads){
+        for(int i=0; i<n_threads; ++i) threads.emplace_back(&worker_pool::worker, this);
+    }
+
+
+    ~worker_pool(){
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        for(auto& t : threads) t.join();
+    }
+
+
+    // runs all tasks on the pool and returns when they are done,
+    // the first exception thrown by a task is rethrown here
+    void run(const std::vector<std::function<void()>>& tasks){
+        std::mutex done_mtx;
+        std::condition_variable done_cv;
+        size_t left = tasks.size();
+        std::exception_ptr err;
+
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            for(auto& t : tasks){
+                queue.push_back([&, t]{
+                    std::exception_ptr e;
+                    try{ t(); }
+                    catch(...){ e = std::current_exception(); }
+
+                    std::lock_guard<std::mutex> lk(done_mtx);
+                    if(e && !err) err = e;
+                    if(--left == 0) done_cv.notify_all();
+                });
+            }
+        }
+        cv.notify_all();
+
+        std::unique_lock<std::mutex> lk(done_mtx);
+        done_cv.wait(lk, [&]{ return left == 0; });
+        if(err) std::rethrow_exception(err);
+    }
+
+private:
+
+    std::vector<std::thread>                 threads;
+    std::mutex                               mtx;
+    std::condition_variable                  cv;
+    std::deque<std::function<void()>>        queue;
+    bool                                     stopping  = false;
+
+
+    void worker(){
+        while(true){
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                cv.wait(lk, [this]{ return stopping || !queue.empty(); });
+                if(queue.empty()) return;
+                task = std::move(queue.front());
+                queue.pop_front();
             }
+            task();
         }
     }
+
+};
+
+
+#define CORRELATE_PARTS 4     // shift space of a correlation is split into this many tasks
+
+
+worker_pool& correlate_pool(){
+    static worker_pool pool(std::max((unsigned int) CORRELATE_PARTS, std::thread::hardware_concurrency()));
+    return pool;
 }
 
 
 
-// wrapper around x_correlate_region, creates 4 threads (hopefully user has a 4-core CPU)
+// wrapper around x_correlate_region, splits the shift space into CORRELATE_PARTS tasks
+// run on correlate_pool()
+// shifts from 0 to max_shift are tried, by default a quarter of the width of a
+template<typename Metric>
 std::pair<int, float> x_correlate(const BMP_image& a, std::pair<int, int> a_start, std::pair<int, int> a_end,
-                                  const BMP_image& b, std::pair<int, int> b_start, std::pair<int, int> b_end)
+                                  const BMP_image& b, std::pair<int, int> b_start, std::pair<int, int> b_end,
+                                  int max_shift)
 {
-    // each thread correlates 1/4th of total shift space
     int width_a = a_end.first - a_start.first + 1;
     int width_b = b_end.first - b_start.first + 1;
 
@@ -103,31 +259,38 @@ std::pair<int, float> x_correlate(const BMP_image& a, std::pair<int, int> a_star
     // int sh_start = -width_b/4+1;
     // TODO restore this
     int sh_start = 0;                  // all images are shifted in one direction
-    int sh_end = width_a/4;
+    int sh_end = max_shift < 0 ? width_a/4 : max_shift;
     int sh_len = sh_end - sh_start;
 
-    // end result is combination of threads' results, threads write here
+    // end result is combination of the tasks' results, tasks write here
     sim_t *res = new sim_t[sh_len];
 
-    // starting threads with their corresponding regions
-    // it's ugly, I know
-    std::thread t1(&x_correlate_region, std::ref(a), a_start, a_end, std::ref(b), b_start, b_end, sh_start, sh_start+sh_len/4, sh_start, res);
-    std::thread t2(&x_correlate_region, std::ref(a), a_start, a_end, std::ref(b), b_start, b_end, sh_start+sh_len/4, sh_start+sh_len/2, sh_start, res);
-    std::thread t3(&x_correlate_region, std::ref(a), a_start, a_end, std::ref(b), b_start, b_end, sh_start+sh_len/2, sh_start+sh_len*3/4, sh_start, res);
-    std::thread t4(&x_correlate_region, std::ref(a), a_start, a_end, std::ref(b), b_start, b_end, sh_start+sh_len*3/4, sh_start+sh_len, sh_start, res);
-    
-    // waiting for threads to finish
-    t1.join();
-    t2.join();
-    t3.join();
-    t4.join();
+    // per region precomputation of the metric, shared by the threads
+    Metric metric(a, a_start, a_end, b, b_start, b_end);
+
+    // each task correlates its part of the shift space
+    std::vector<std::function<void()>> tasks;
+    for(int k=0; k<CORRELATE_PARTS; ++k){
+        int from = sh_start + sh_len*k/CORRELATE_PARTS, to = sh_start + sh_len*(k+1)/CORRELATE_PARTS;
+        tasks.push_back([&, from, to]{
+            x_correlate_region<Metric>(a, a_start, a_end, b, b_start, b_end, from, to, sh_start, res, metric);
+        });
+    }
+
+    try{
+        correlate_pool().run(tasks);
+    }
+    catch(...){
+        delete[] res;
+        throw;
+    }
 
     // find minimum activation
     int fs = 0;
     for(int i=0; i<sh_len; ++i) if(res[i] < res[fs]) fs = i;
 
-    // score (confidence) is calculated linearly: 1 at 0 diff, 0 at maximum possible diff
-    float score = res[fs] * -1/(width_a*(a_end.second - a_start.second + 1)) + 1;
+    // score (confidence) is 1 at a perfect match, 0 at the worst possible one
+    float score = Metric::score(res[fs], width_a*(a_end.second - a_start.second + 1));
     
     // -------------------------------------------------------------------------
     // for(int i=0; i<sh_len-1; ++i){
@@ -139,7 +302,7 @@ std::pair<int, float> x_correlate(const BMP_image& a, std::pair<int, int> a_star
     delete[] res;
 
     if(score < SCORE_THRESHOLD){
-        std::cout << "Warning: correlation between regions of images '" << a.filenm << "' and '" << b.filenm
+        std::cout << "Warning: correlation between regions of images '" << a.filename() << "' and '" << b.filename()
                   << "' resulted in a match scoring " << score << ", lower than threshold (" << SCORE_THRESHOLD << ")" << std::endl;
     }
 
@@ -147,6 +310,19 @@ std::pair<int, float> x_correlate(const BMP_image& a, std::pair<int, int> a_star
 }
 
 
+// picks the metric at runtime, the kernels themselves have no dispatch in them
+std::pair<int, float> x_correlate(const BMP_image& a, std::pair<int, int> a_start, std::pair<int, int> a_end,
+                                  const BMP_image& b, std::pair<int, int> b_start, std::pair<int, int> b_end,
+                                  int max_shift = -1, metric_t metric = METRIC_SAD)
+{
+    switch(metric){
+        case METRIC_SSD:  return x_correlate<ssd_metric>(a, a_start, a_end, b, b_start, b_end, max_shift);
+        case METRIC_ZNCC: return x_correlate<zncc_metric>(a, a_start, a_end, b, b_start, b_end, max_shift);
+        default:          return x_correlate<sad_metric>(a, a_start, a_end, b, b_start, b_end, max_shift);
+    }
+}
+
+
 
 // resizes region of image a (enlarges over x axis with given scale factor)
 // (linear interpolation) and writes it starting at the specified location in image b
@@ -158,6 +334,9 @@ void x_enlarge_region(const BMP_image& a, std::pair<int, int> a_start, std::pair
     int new_w = floor(width * scale);
     float x, x_0, x_1;  // source pixel and its neighbors
 
+#ifdef PIXEL_SCALAR
+    // reference path, single pixel operators
+
     // outer loop with j for cache efficiency
     for(int j=0; j<height; ++j){
         for(int i=0; i<new_w; ++i){
@@ -174,36 +353,212 @@ void x_enlarge_region(const BMP_image& a, std::pair<int, int> a_start, std::pair
                                                    a.ploc(a_start.first+x_1, a_start.second+j)*(x - x_0);
         }
     }
+#else
+    if(new_w <= 0 || height <= 0) return;
+
+    // neighbors and weights only depend on the column, computed once
+    std::vector<int> c_0(new_w), c_1(new_w);
+    std::vector<float> w_0(new_w), w_1(new_w);
+    std::vector<uint16_t> t(new_w);
+
+    for(int i=0; i<new_w; ++i){
+        x = i / scale;
+        x_0 = floor(x);
+        x_1 = ceil(x);
+
+        if(x_0 == x_1) x_1 += 1.0f;         // x is an integer
+        if(x_1 == width) x_1 = width-1;     // out of bounds : replicate edge pixel
+        if(x_0 == x_1) x_0 -= 1.0f;
+
+        c_0[i] = x_0;
+        c_1[i] = x_1;
+        w_0[i] = x_1 - x;
+        w_1[i] = x - x_0;
+        t[i] = fx_weight(w_1[i]);
+    }
+
+    // columns past the last source pixel extrapolate (weight above 1), those few are
+    // left to the single pixel operators
+    int n_span = new_w;
+    while(n_span > 0 && w_1[n_span-1] > 1) --n_span;
+
+    std::vector<pixel> p_0(new_w), p_1(new_w);
+
+    for(int j=0; j<height; ++j){
+        const pixel* src = &a.ploc(a_start.first, a_start.second+j);
+        pixel* dst = &b(b_start.first, b_start.second+j);
+
+        for(int i=0; i<n_span; ++i){
+            p_0[i] = src[c_0[i]];
+            p_1[i] = src[c_1[i]];
+        }
+
+        // linear interpolation between neighbor pixels
+        lerp_span(dst, p_0.data(), p_1.data(), t.data(), n_span);
+
+        for(int i=n_span; i<new_w; ++i) dst[i] = src[c_0[i]]*w_0[i] + src[c_1[i]]*w_1[i];
+    }
+#endif
+}
+
+
+
+#define MASK_BAND_ROWS 64     // rows read at a time for the background of a banded frame
+
+
+// foreground mask: frames are mostly uniform background around the pot, pixels that differ
+// from the background color (median of the left and right borders of the whole frame)
+// by at most tol are skipped
+struct fg_mask {
+
+    pixel   bg;
+    int     tol;
+
+
+    fg_mask(const BMP_image& img, int tol)
+    : tol(tol)
+    {
+        std::vector<uint8_t> r, g, b;
+        add_border(img, r, g, b);
+        set_bg(r, g, b);
+    }
+
+
+    // same background as for the whole image, read band by band
+    fg_mask(BMP_reader& img, int tol)
+    : tol(tol)
+    {
+        std::vector<uint8_t> r, g, b;
+        for(unsigned int r0=0; r0<img.info_h.height; r0+=MASK_BAND_ROWS){
+            add_border(img.read_rows(r0, std::min((unsigned int) MASK_BAND_ROWS, img.info_h.height - r0)), r, g, b);
+        }
+        set_bg(r, g, b);
+    }
+
+
+    bool is_fg(const pixel& p) const {
+        return (p * bg) * 255 > tol;
+    }
+
+
+    // first and last foreground column in rows r0 ... r1 (first > last if there is none)
+    std::pair<int, int> columns(const BMP_image& img, unsigned int r0, unsigned int r1) const {
+        int w = img.info_h.width;
+        int c0 = w, c1 = -1;
+        for(int j=r0; j<=r1; ++j){
+            for(int i=0; i<c0; ++i) if(is_fg(img.ploc(i, j))){ c0 = i; break; }
+            for(int i=w-1; i>c1; --i) if(is_fg(img.ploc(i, j))){ c1 = i; break; }
+        }
+        return { c0, c1 };
+    }
+
+private:
+
+    static void add_border(const BMP_image& img, std::vector<uint8_t>& r, std::vector<uint8_t>& g, std::vector<uint8_t>& b){
+        for(int j=0; j<img.info_h.height; ++j){
+            for(int i : { 0, img.info_h.width-1 }){
+                r.push_back(img.ploc(i, j).r);
+                g.push_back(img.ploc(i, j).g);
+                b.push_back(img.ploc(i, j).b);
+            }
+        }
+    }
+
+
+    void set_bg(std::vector<uint8_t>& r, std::vector<uint8_t>& g, std::vector<uint8_t>& b){
+        for(auto c : { &r, &g, &b }) std::nth_element(c->begin(), c->begin() + c->size()/2, c->end());
+        bg = pixel(r[r.size()/2], g[g.size()/2], b[b.size()/2]);
+    }
+
+};
+
+
+
+// correlates rows r0 ... r1 of a and b (full width). with masks the columns left of the
+// foreground (less the largest shift) and right of it are skipped: every pair of pixels
+// with a foreground pixel in it is still compared, only background against background is
+// left out. a strip without foreground is not correlated (shift -1)
+std::pair<int, float> x_correlate_strip(const BMP_image& a, const BMP_image& b, unsigned int r0, unsigned int r1,
+                                        const fg_mask* ma = nullptr, const fg_mask* mb = nullptr, metric_t metric = METRIC_SAD)
+{
+    int w = a.info_h.width;
+
+    if(!ma || !mb) return x_correlate(a, {0, r0}, {w-1, r1}, b, {0, r0}, {w-1, r1}, -1, metric);
+
+    auto ca = ma->columns(a, r0, r1);
+    auto cb = mb->columns(b, r0, r1);
+    int c0 = std::min(ca.first, cb.first);
+    int c1 = std::max(ca.second, cb.second);
+
+    if(c0 > c1) return { -1, 1 };
+
+    // zncc is normalized by the overlap, so it can leave out the silhouette, which doesn't
+    // move and whose edges would outweigh the texture: only the foreground both frames
+    // share is compared, b's narrower by the largest shift so it stays inside a's
+    if(metric == METRIC_ZNCC){
+        int f0 = std::max(ca.first, cb.first), f1 = std::min(ca.second, cb.second);
+        int max_shift = std::min(w/4, (f1 - f0 + 1) / 2);
+        if(max_shift < 1) return { -1, 1 };
+        return x_correlate(a, {f0, r0}, {f1, r1}, b, {f0, r0}, {f1 - max_shift, r1}, max_shift, metric);
+    }
+
+    // at shift s column i of b meets column i+s of a, so b has to start up to the largest
+    // shift left of the foreground for a's first foreground columns to be compared
+    c0 = std::max(0, c0 - w/4);
+
+    // same shift space as the full width correlation
+    return x_correlate(a, {c0, r0}, {w-1, r1}, b, {c0, r0}, {c1, r1}, w/4, metric);
+}
+
+
+
+// converts per-strip shifts to psf values (scale factors relative to the maximum shift)
+// strips that were not correlated (shift -1) take the shift of their nearest neighbour
+std::vector<float> shifts_to_psf(std::vector<int> sh, int max_shift){
+    std::vector<float> psf;
+    psf.reserve(sh.size());
+
+    for(int i=1; i<sh.size(); ++i) if(sh[i] < 0) sh[i] = sh[i-1];
+    for(int i=(int) sh.size()-2; i>=0; --i) if(sh[i] < 0) sh[i] = sh[i+1];
+
+    for(const int& s : sh) psf.push_back((float) max_shift/s);
+
+    // handle +- inf or nan values
+    for(int i=0; i<psf.size(); ++i) if(std::isinf(psf[i]) || std::isnan(psf[i])) psf[i] = (i == 0) ? 0 : psf[i-1];
+
+    return psf;
 }
 
 
 
 // returns a vector of shifts between img1 and img2 using strips of th (thickness) pixels
-std::vector<float> calc_psf(const BMP_image& img1, const BMP_image& img2, int* maxshift, unsigned int th /* = 100 */){
+// bg_tol >= 0 correlates only the foreground of each strip (see fg_mask)
+std::vector<float> calc_psf(const BMP_image& img1, const BMP_image& img2, int* maxshift, unsigned int th /* = 100 */,
+                            int bg_tol = -1, metric_t metric = METRIC_SAD)
+{
     int n_strips = (int) ceil((float) img1.info_h.height / th);
     std::vector<int> sh;
-    std::vector<float> psf;
     sh.reserve(n_strips);
-    psf.reserve(n_strips);
-    unsigned int w = img1.info_h.width;
     unsigned int h = img1.info_h.height;
     int max_shift = 0;
 
+    // masks are computed once per frame
+    fg_mask* m1 = bg_tol >= 0 ? new fg_mask(img1, bg_tol) : nullptr;
+    fg_mask* m2 = bg_tol >= 0 ? new fg_mask(img2, bg_tol) : nullptr;
+
     for(int i=0; i<n_strips; ++i){
-        auto corr = x_correlate(img1, {0, i*th}, {w-1, std::min((i+1)*th-1, h-1)}, img2, {0, i*th}, {w-1, std::min((i+1)*th-1, h-1)});
+        auto corr = x_correlate_strip(img1, img2, i*th, std::min((i+1)*th-1, h-1), m1, m2, metric);
         sh.push_back(corr.first);
         if(corr.first > max_shift) max_shift = corr.first;
         // std::cout << std::setw(4) << i*th << " - " << std::setw(4) << min((i+1)*th-1, h-1) << " : " << corr.first << ", " << corr.second << endl;
     }
 
-    *maxshift = max_shift;
+    delete m1;
+    delete m2;
 
-    for(const int& s : sh) psf.push_back((float) max_shift/s);
-
-    // handle +- inf or nan values
-    for(int i=0; i<psf.size(); ++i) if(std::isinf(psf[i]) || std::isnan(psf[i])) psf[i] = (i == 0) ? 0 : psf[i-1];
+    *maxshift = max_shift;
 
-    return psf;
+    return shifts_to_psf(sh, max_shift);
 }
 
 
@@ -248,6 +603,254 @@ BMP_image cut_strip(const BMP_image& img, unsigned int strip_width){
 
 
 
+// banded execution: strips are independent of each other, so instead of whole frames
+// only band_rows rows (rounded up to a multiple of th) are held in memory at a time
+
+unsigned int round_band(unsigned int band_rows, unsigned int th){
+    return std::max(1u, (band_rows + th - 1) / th) * th;
+}
+
+
+// same as calc_psf, but reads img1 and img2 band by band
+std::vector<float> calc_psf_banded(BMP_reader& img1, BMP_reader& img2, int* maxshift, unsigned int th, unsigned int band_rows,
+                                   int bg_tol = -1, metric_t metric = METRIC_SAD)
+{
+    unsigned int h = img1.info_h.height;
+    int n_strips = (int) ceil((float) h / th);
+    std::vector<int> sh;
+    sh.reserve(n_strips);
+    int max_shift = 0;
+
+    band_rows = round_band(band_rows, th);
+
+    // masks are computed once per frame, the same as for whole images
+    fg_mask* ma = bg_tol >= 0 ? new fg_mask(img1, bg_tol) : nullptr;
+    fg_mask* mb = bg_tol >= 0 ? new fg_mask(img2, bg_tol) : nullptr;
+
+    for(unsigned int r0=0; r0<h; r0+=band_rows){
+        unsigned int n = std::min(band_rows, h - r0);
+        BMP_image a = img1.read_rows(r0, n);
+        BMP_image b = img2.read_rows(r0, n);
+
+        // strip coordinates are relative to the band
+        for(unsigned int s=0; s<n; s+=th){
+            auto corr = x_correlate_strip(a, b, s, std::min(s+th, n)-1, ma, mb, metric);
+            sh.push_back(corr.first);
+            if(corr.first > max_shift) max_shift = corr.first;
+        }
+    }
+
+    delete ma;
+    delete mb;
+
+    *maxshift = max_shift;
+
+    return shifts_to_psf(sh, max_shift);
+}
+
+
+// same as cut_strip(psf_resize(img, psf, th), strip_width), but reads img band by band
+// and appends the cut strips of each band to out
+void psf_resize_cut_banded(BMP_reader& img, const std::vector<float>& psf, unsigned int th,
+                           unsigned int strip_width, BMP_writer& out, unsigned int band_rows)
+{
+    float max_psf = 0;
+    for(auto& p : psf) if(p > max_psf) max_psf = p;
+
+    unsigned int width = img.info_h.width;
+    unsigned int height = img.info_h.height;
+    int new_w = width * max_psf;
+
+    band_rows = round_band(band_rows, th);
+
+    for(unsigned int r0=0; r0<height; r0+=band_rows){
+        unsigned int n = std::min(band_rows, height - r0);
+        BMP_image band = img.read_rows(r0, n);
+        BMP_image res(new_w, n);
+
+        for(unsigned int s=0; s<n; s+=th){
+            int i = (r0 + s) / th;
+            x_enlarge_region(band, {0, s}, {width-1, std::min(s+th, n)}, res, {(int) floor((new_w - floor(width*psf[i]))/2), s}, psf[i]);
+        }
+
+        out.write_rows(cut_strip(res, strip_width));
+    }
+}
+
+
+
+// smooths out the stitch between columns c-1 and c by interpolating columns c-3 ... c+3
+// between columns c-4 and c+4
+void blend_seam(BMP_image& res, int c_width){
+#ifdef PIXEL_SCALAR
+    for(int j=0; j<res.info_h.height; ++j){
+        res(c_width, j)   = res(c_width-4, j)*0.5       + res(c_width+4, j)*0.5;
+        res(c_width-1, j) = res(c_width-4, j)*(5.0/8.0) + res(c_width+4, j)*(3.0/8.0);
+        res(c_width+1, j) = res(c_width-4, j)*(3.0/8.0) + res(c_width+4, j)*(5.0/8.0);
+        res(c_width-2, j) = res(c_width-4, j)*(6.0/8.0) + res(c_width+4, j)*(2.0/8.0);
+        res(c_width+2, j) = res(c_width-4, j)*(2.0/8.0) + res(c_width+4, j)*(6.0/8.0);
+        res(c_width-3, j) = res(c_width-4, j)*(7.0/8.0) + res(c_width+4, j)*(1.0/8.0);
+        res(c_width+3, j) = res(c_width-4, j)*(1.0/8.0) + res(c_width+4, j)*(7.0/8.0);
+        // res(c_width-4, j) = res(c_width-6, j)*(10.0/12.0) + res(c_width+6, j)*(2.0 /12.0);
+        // res(c_width+4, j) = res(c_width-6, j)*(2.0 /12.0) + res(c_width+6, j)*(10.0/12.0);
+        // res(c_width-5, j) = res(c_width-6, j)*(11.0/12.0) + res(c_width+6, j)*(1.0 /12.0);
+        // res(c_width+5, j) = res(c_width-6, j)*(1.0 /12.0) + res(c_width+6, j)*(11.0/12.0);
+    }
+#else
+    // same weights on whole columns at a time (multiples of 1/8, exact in fixed point)
+    int h = res.info_h.height;
+    std::vector<pixel> l(h), r(h), col(h);
+
+    for(int j=0; j<h; ++j){
+        l[j] = res(c_width-4, j);
+        r[j] = res(c_width+4, j);
+    }
+
+    for(int d=-3; d<=3; ++d){
+        lerp_span(col.data(), l.data(), r.data(), (d+4) / 8.0f, h);
+        for(int j=0; j<h; ++j) res(c_width+d, j) = col[j];
+    }
+#endif
+}
+
+
+
+// psf of a (relative to its next frame b), resize and cut in one go
+BMP_image frame_strip(const BMP_image& a, const BMP_image& b, unsigned int resolution){
+    int maxshift = 0;
+    auto psf = calc_psf(a, b, &maxshift, resolution);
+    return cut_strip(psf_resize(a, psf, resolution), maxshift);
+}
+
+
+
+// sparse sampling: the shift profile is a smooth function of the row (the pot is a surface
+// of revolution), so only every step-th strip is correlated and the rest are interpolated.
+// each interval between samples is checked at its middle strip and split further if the
+// interpolation misses by more than SPARSE_TOLERANCE pixels or an end scored badly
+
+#define SPARSE_TOLERANCE 1
+
+
+// corr(i) correlates strip i and returns {shift, score} like x_correlate
+template<typename Corr>
+std::vector<float> calc_psf_sparse(int n_strips, Corr corr, int* maxshift, unsigned int step){
+    std::vector<int> sh(n_strips);
+    std::vector<float> score(n_strips);
+
+    auto sample = [&](int i){
+        auto c = corr(i);
+        sh[i] = c.first;
+        score[i] = c.second;
+    };
+
+    // linear interpolation of the shift of strip i between strips lo and hi
+    auto interp = [&](int lo, int hi, int i){
+        return (int) round(sh[lo] + (float) (sh[hi] - sh[lo]) * (i - lo) / (hi - lo));
+    };
+
+    // fills (lo, hi), both ends already sampled
+    std::function<void(int, int)> refine = [&](int lo, int hi){
+        if(hi - lo <= 1) return;
+
+        // a strip without foreground (shift -1) is nothing to interpolate from. between two
+        // of them the strips stay -1 and take the nearest shift (shifts_to_psf), between one
+        // of them and a shift the edge of the foreground is found by bisection, the part
+        // with shifts at both ends is refined as usual
+        if(sh[lo] < 0 && sh[hi] < 0){
+            for(int i=lo+1; i<hi; ++i) sh[i] = -1;
+            return;
+        }
+        if(sh[lo] < 0 || sh[hi] < 0){
+            int mid = (lo + hi) / 2;
+            sample(mid);
+            refine(lo, mid);
+            refine(mid, hi);
+            return;
+        }
+
+        int mid = (lo + hi) / 2;
+        sample(mid);
+
+        if(abs(sh[mid] - interp(lo, hi, mid)) > SPARSE_TOLERANCE || score[lo] < SCORE_THRESHOLD || score[hi] < SCORE_THRESHOLD){
+            refine(lo, mid);
+            refine(mid, hi);
+        }
+        else{
+            for(int i=lo+1; i<mid; ++i) sh[i] = interp(lo, mid, i);
+            for(int i=mid+1; i<hi; ++i) sh[i] = interp(mid, hi, i);
+        }
+    };
+
+    step = std::max(1u, step);
+
+    int prev = 0;
+    sample(0);
+    for(int i=step; i<n_strips-1+step; i+=step){
+        int cur = std::min(i, n_strips-1);
+        sample(cur);
+        refine(prev, cur);
+        prev = cur;
+    }
+
+    int max_shift = 0;
+    for(auto s : sh) if(s > max_shift) max_shift = s;
+
+    *maxshift = max_shift;
+
+    return shifts_to_psf(sh, max_shift);
+}
+
+
+std::vector<float> calc_psf_sparse(const BMP_image& img1, const BMP_image& img2, int* maxshift, unsigned int th, unsigned int step,
+                                   int bg_tol = -1, metric_t metric = METRIC_SAD)
+{
+    int n_strips = (int) ceil((float) img1.info_h.height / th);
+    unsigned int h = img1.info_h.height;
+
+    fg_mask* m1 = bg_tol >= 0 ? new fg_mask(img1, bg_tol) : nullptr;
+    fg_mask* m2 = bg_tol >= 0 ? new fg_mask(img2, bg_tol) : nullptr;
+
+    auto corr = [&](int i){
+        return x_correlate_strip(img1, img2, i*th, std::min((i+1)*th-1, h-1), m1, m2, metric);
+    };
+
+    auto psf = calc_psf_sparse(n_strips, corr, maxshift, step);
+
+    delete m1;
+    delete m2;
+
+    return psf;
+}
+
+
+// sparse and banded: only the sampled strips are read (and the whole frame once for the masks)
+std::vector<float> calc_psf_sparse(BMP_reader& img1, BMP_reader& img2, int* maxshift, unsigned int th, unsigned int step,
+                                   int bg_tol = -1, metric_t metric = METRIC_SAD)
+{
+    unsigned int h = img1.info_h.height;
+    int n_strips = (int) ceil((float) h / th);
+
+    fg_mask* m1 = bg_tol >= 0 ? new fg_mask(img1, bg_tol) : nullptr;
+    fg_mask* m2 = bg_tol >= 0 ? new fg_mask(img2, bg_tol) : nullptr;
+
+    auto corr = [&](int i){
+        unsigned int n = std::min((i+1)*th, h) - i*th;
+        BMP_image a = img1.read_rows(i*th, n);
+        BMP_image b = img2.read_rows(i*th, n);
+        return x_correlate_strip(a, b, 0, n-1, m1, m2, metric);
+    };
+
+    auto psf = calc_psf_sparse(n_strips, corr, maxshift, step);
+
+    delete m1;
+    delete m2;
+
+    return psf;
+}
+
+
+
 // glues images together
 BMP_image merge(std::vector<const BMP_image *> imgs){
     // calculate total width
@@ -270,19 +873,7 @@ BMP_image merge(std::vector<const BMP_image *> imgs){
     // interpolate touching regions to smooth out stitches
     c_width = imgs[0]->info_h.width;
     for(int n=1; n<imgs.size(); ++n){
-        for(int j=0; j<res.info_h.height; ++j){
-            res(c_width, j)   = res(c_width-4, j)*0.5       + res(c_width+4, j)*0.5;
-            res(c_width-1, j) = res(c_width-4, j)*(5.0/8.0) + res(c_width+4, j)*(3.0/8.0);
-            res(c_width+1, j) = res(c_width-4, j)*(3.0/8.0) + res(c_width+4, j)*(5.0/8.0);
-            res(c_width-2, j) = res(c_width-4, j)*(6.0/8.0) + res(c_width+4, j)*(2.0/8.0);
-            res(c_width+2, j) = res(c_width-4, j)*(2.0/8.0) + res(c_width+4, j)*(6.0/8.0);
-            res(c_width-3, j) = res(c_width-4, j)*(7.0/8.0) + res(c_width+4, j)*(1.0/8.0);
-            res(c_width+3, j) = res(c_width-4, j)*(1.0/8.0) + res(c_width+4, j)*(7.0/8.0);
-            // res(c_width-4, j) = res(c_width-6, j)*(10.0/12.0) + res(c_width+6, j)*(2.0 /12.0);
-            // res(c_width+4, j) = res(c_width-6, j)*(2.0 /12.0) + res(c_width+6, j)*(10.0/12.0);
-            // res(c_width-5, j) = res(c_width-6, j)*(11.0/12.0) + res(c_width+6, j)*(1.0 /12.0);
-            // res(c_width+5, j) = res(c_width-6, j)*(1.0 /12.0) + res(c_width+6, j)*(11.0/12.0);
-        }
+        blend_seam(res, c_width);
         c_width += imgs[n]->info_h.width;
     }
 
@@ -290,6 +881,31 @@ BMP_image merge(std::vector<const BMP_image *> imgs){
 }
 
 
+// rows r0 ... r0+n-1 of merge() of the images behind readers, only those rows are read
+BMP_image merge_rows(const std::vector<BMP_reader*>& readers, unsigned int r0, unsigned int n){
+    unsigned int res_width = 0;
+    for(auto r : readers) res_width += r->info_h.width;
+
+    BMP_image res(res_width, n);
+
+    int c_width = 0;
+    for(auto r : readers){
+        BMP_image band = r->read_rows(r0, n);
+        for(int j=0; j<n; ++j) std::copy(&band.data[j*band.info_h.width], &band.data[(j+1)*band.info_h.width], &res(c_width, j));
+        c_width += band.info_h.width;
+    }
+
+    // seams only mix pixels of the same row, so blending band by band gives the same result
+    c_width = readers[0]->info_h.width;
+    for(int k=1; k<readers.size(); ++k){
+        blend_seam(res, c_width);
+        c_width += readers[k]->info_h.width;
+    }
+
+    return res;
+}
+
+
 
 // psf file I/O
 
@@ -297,8 +913,7 @@ void write_psf(const char* filename, const std::vector<float>& psf, unsigned int
     std::ofstream out(filename);
     if(!out){
         // error opening file
-        std::cerr << "Unable to write to file \'" <<filename << "\'" << std::endl;
-        exit(1);
+        throw std::runtime_error("Unable to write to file '" + std::string(filename) + "'");
     }
     out << psf.size() << std::endl;
     out << resolution << std::endl;
@@ -312,23 +927,152 @@ std::vector<float> read_psf(const char* filename, unsigned int* resolution, int*
     std::ifstream in(filename);
     if(!in){
         // error opening file
-        std::cerr << "Unable to read from file \'" <<filename << "\'" << std::endl;
-        exit(1);
+        throw std::runtime_error("Unable to read from file '" + std::string(filename) + "'");
     }
     std::vector<float> psf;
     int n_strips;
     float p;
     in >> n_strips;
-    psf.reserve(n_strips);
     in >> *resolution;
     in >> *maxshift;
+    if(!in || n_strips < 0){
+        throw std::runtime_error("File '" + std::string(filename) + "' is not a psf file");
+    }
+    psf.reserve(n_strips);
     for(int i=0; i<n_strips; ++i){
         in >> p;
         psf.push_back(p);
     }
+    if(!in){
+        throw std::runtime_error("File '" + std::string(filename) + "' is truncated");
+    }
     return psf;
 }
 
 
 
+// "frame2.bmp" < "frame10.bmp", same order as 'sort -V' in run.sh
+bool natural_less(const std::string& a, const std::string& b){
+    size_t i = 0, j = 0;
+    while(i < a.size() && j < b.size()){
+        if(isdigit(a[i]) && isdigit(b[j])){
+            size_t ie = i, je = j;
+            while(ie < a.size() && isdigit(a[ie])) ++ie;
+            while(je < b.size() && isdigit(b[je])) ++je;
+            unsigned long na = std::stoul(a.substr(i, ie-i)), nb = std::stoul(b.substr(j, je-j));
+            if(na != nb) return na < nb;
+            i = ie;
+            j = je;
+        }
+        else{
+            if(a[i] != b[j]) return a[i] < b[j];
+            ++i;
+            ++j;
+        }
+    }
+    return a.size() - i < b.size() - j;
+}
+
+
+// .bmp files in dir, in natural order
+std::vector<std::string> list_frames(const char* dir){
+    std::vector<std::string> frames;
+    for(auto& e : std::filesystem::directory_iterator(dir)){
+        if(e.path().extension() == ".bmp") frames.push_back(e.path().string());
+    }
+    std::sort(frames.begin(), frames.end(), natural_less);
+    return frames;
+}
+
+
+
+// operations, shared by the command line (main.cpp) and the job server (server.hpp)
+// band_rows == 0 means whole images are loaded
+
+#define ZNCC_MASK_TOL 16     // foreground mask tolerance zncc uses when none is given
+
+// sparse_step == 0 means every strip is correlated, bg_tol < 0 means no foreground mask
+// (zncc always uses one, see x_correlate_strip)
+void op_psf(const char* img1, const char* img2, const char* psf_file, unsigned int resolution,
+            unsigned int band_rows = 0, unsigned int sparse_step = 0, int bg_tol = -1, metric_t metric = METRIC_SAD)
+{
+    if(metric == METRIC_ZNCC && bg_tol < 0) bg_tol = ZNCC_MASK_TOL;
+
+    int maxshift = 0;
+    std::vector<float> psf;
+
+    if(band_rows){
+        BMP_reader a(img1);
+        BMP_reader b(img2);
+        if(sparse_step) psf = calc_psf_sparse(a, b, &maxshift, resolution, sparse_step, bg_tol, metric);
+        else psf = calc_psf_banded(a, b, &maxshift, resolution, band_rows, bg_tol, metric);
+    }
+    else{
+        BMP_image a(img1);
+        BMP_image b(img2);
+        if(sparse_step) psf = calc_psf_sparse(a, b, &maxshift, resolution, sparse_step, bg_tol, metric);
+        else psf = calc_psf(a, b, &maxshift, resolution, bg_tol, metric);
+    }
+
+    // --scale can't cut a strip of width 0
+    if(maxshift <= 0){
+        throw std::runtime_error("No shift found between '" + std::string(img1) + "' and '" + std::string(img2)
+                                + "', not writing psf file '" + std::string(psf_file) + "'");
+    }
+
+    // psf file format: n_strips \n thickness \n maxshift \n psf1 \n ... psfN \n
+    write_psf(psf_file, psf, resolution, maxshift);
+}
+
+
+void op_scale(const char* img, const char* psf_file, const char* out_img, unsigned int band_rows = 0){
+    unsigned int resolution = 0;
+    int maxshift = 0;
+
+    auto psf = read_psf(psf_file, &resolution, &maxshift);
+
+    if(band_rows){
+        BMP_reader a(img);
+        BMP_writer out(out_img, maxshift, a.info_h.height);
+        psf_resize_cut_banded(a, psf, resolution, maxshift, out, band_rows);
+    }
+    else{
+        BMP_image a(img);
+        cut_strip(psf_resize(a, psf, resolution), maxshift).save_as(out_img);
+    }
+}
+
+
+void op_merge(const char* out_img, const std::vector<const char*>& img_files){
+    // owned here, so nothing leaks if reading one of them throws
+    std::vector<BMP_image> loaded;
+    loaded.reserve(img_files.size());
+    for(auto f : img_files) loaded.emplace_back(f);
+
+    std::vector<const BMP_image*> images;
+    for(auto& i : loaded) images.push_back(&i);
+
+    merge(images).save_as(out_img);
+}
+
+
+// psf and scale in one go, the psf profile is kept in memory instead of a file
+void op_pipeline(const char* img1, const char* img2, const char* out_img, unsigned int resolution, unsigned int band_rows = 0){
+    if(band_rows){
+        int maxshift = 0;
+        BMP_reader a(img1);
+        BMP_reader b(img2);
+        auto psf = calc_psf_banded(a, b, &maxshift, resolution, band_rows);
+        BMP_writer out(out_img, maxshift, a.info_h.height);
+        psf_resize_cut_banded(a, psf, resolution, maxshift, out, band_rows);
+    }
+    else{
+        BMP_image a(img1);
+        BMP_image b(img2);
+        frame_strip(a, b, resolution).save_as(out_img);
+    }
+}
+
+
+
 #endif // __UTIL_HPP
\ No newline at end of file
@@ -16,15 +16,45 @@ print_help(){
     echo "  -m <img_dir> <out_img>                 :  Merge all images in given directory and save result as <out_img>"
     echo ""
     echo ""
+    echo "  -z <img_dir> <out_dir>                 :  Like -m, but write a tiled zoom pyramid to <out_dir>"
+    echo ""
+    echo ""
     echo "  -f <img_dir> <out_img>                 :  Fully automatic, do everything to get <out_img> from <img_dir>"
     echo "                                            uses 'temp/psf' to store psf files and 'temp/resized' for intermediate results"
+    echo "                                            finished frames are journaled in 'temp/journal', running it again"
+    echo "                                            on the same <img_dir> resumes an interrupted run"
+    echo ""
+    echo ""
+    echo "  -P <img_dir> <psf_dir> <n_workers>     :  Like -p, but with <n_workers> worker processes sharing a"
+    echo "                                            work queue in 'temp/queue'. More workers can be started"
+    echo "                                            on other machines with 'build/flt --work <queue_dir>'"
+    echo ""
+    echo ""
+    echo "  -b <ram_mib> <img_dir_1> <out_img_1> [<img_dir_2> <out_img_2> ...]"
+    echo "                                         :  Like -f for many scans at once, sharing one process and"
+    echo "                                            a memory budget of <ram_mib> MiB. Scans don't share temp files"
     echo ""
     echo ""
     echo "  -h                                     :  Display this"
     echo ""
+    echo "  Set BAND_ROWS=<rows> to make -p and -s process images <rows> rows at a time"
+    echo "  Set PSF_SPARSE=<step> to make -p correlate only every <step>-th strip and interpolate the rest"
+    echo "  Set PSF_MASK=<tol> to make -p correlate only pixels further than <tol> from the background color"
+    echo "  Set PSF_METRIC=<sad|ssd|zncc> to pick the similarity metric used by -p"
+    echo "  Set JOURNAL=<file> to make -p and -s skip frames already recorded as done in <file>"
+    echo "  Set STRIP_FORMAT=flz to make -s write compressed strips (default for -f), -m reads both"
+    echo ""
 }
 
 
+# optional banded processing for very tall frames
+band_args=${BAND_ROWS:+--band $BAND_ROWS}
+sparse_args=${PSF_SPARSE:+--sparse $PSF_SPARSE}
+mask_args=${PSF_MASK:+--mask $PSF_MASK}
+metric_args=${PSF_METRIC:+--metric $PSF_METRIC}
+journal_args=${JOURNAL:+--journal $JOURNAL}
+
+
 if [ $# -ge 3 ]
 then
     case $1 in
@@ -41,15 +71,37 @@ then
         echo "[*] calculating psf"
 
         for ((i=0; i<n_files-1; i++)); do
-            build/flt --psf "$img_dir/${files[$i]}" "$img_dir/${files[$((i+1))]}" "$psf_dir/${files[$i]}.psf"
+            build/flt --psf "$img_dir/${files[$i]}" "$img_dir/${files[$((i+1))]}" "$psf_dir/${files[$i]}.psf" $band_args $sparse_args $mask_args $metric_args $journal_args
             echo -ne "\rCalculating psf: $((i+1))/$n_files"
         done
-        build/flt --psf "$img_dir/${files[$((n_files-1))]}" "$img_dir/${files[0]}" "$psf_dir/${files[$((n_files-1))]}.psf"
+        build/flt --psf "$img_dir/${files[$((n_files-1))]}" "$img_dir/${files[0]}" "$psf_dir/${files[$((n_files-1))]}.psf" $band_args $sparse_args $mask_args $metric_args $journal_args
         echo -ne "\rCalculating psf: $n_files/$n_files"
         echo ""
         echo "[.] done calculating psf"
         ;;
 
+    -P)
+        # psf, sharded over worker processes
+        img_dir="$2"
+        psf_dir="$3"
+        n_workers="${4:-4}"
+        queue_dir="temp/queue"
+
+        rm -rf "$queue_dir"
+
+        build/flt --coordinate "$img_dir" "$psf_dir" "$queue_dir" 30 $band_args $sparse_args $mask_args $metric_args &
+        coordinator=$!
+
+        for ((i=0; i<n_workers; i++)); do
+            build/flt --work "$queue_dir" > /dev/null &
+        done
+
+        wait $coordinator
+        status=$?
+        wait
+        exit $status
+        ;;
+
     -s)
         # scale
         img_dir="$2"
@@ -66,7 +118,7 @@ then
         for file in $(ls -1 $img_dir | sort -V)
         do
             echo -ne "\rScaling: $a/$n_files"
-            build/flt --scale "$img_dir/$file" "$psf_dir/$file.psf" "$resized_dir/${file%.bmp}_resized.bmp"
+            build/flt --scale "$img_dir/$file" "$psf_dir/$file.psf" "$resized_dir/${file%.bmp}_resized.${STRIP_FORMAT:-bmp}" $band_args $journal_args
             let a++
         done
         echo ""
@@ -91,6 +143,24 @@ then
         echo "=== DONE ==="
         ;;
 
+    -z)
+        # merge into a tile pyramid
+        img_dir="$2"
+        out_dir="$3"
+
+        args=""
+        for file in $(ls -1 $img_dir | sort -V)
+        do
+            args="$args $img_dir/$file"
+        done
+
+        echo "[*] merging into pyramid"
+
+        build/flt --pyramid "$out_dir" $args
+
+        echo "=== DONE ==="
+        ;;
+
     -f)
         # full automatic
         img_dir="$2"
@@ -98,13 +168,43 @@ then
         resized_dir="temp/resized"
         out_img="$3"
 
-        rm -rf "$psf_dir" "$resized_dir"
-
-        mkdir -p $psd_dir $resized_dir
+        # finished frames are journaled, a rerun on the same img_dir resumes where the last one stopped
+        export JOURNAL="temp/journal"
+        # intermediates are only read back by -m, keep them compressed
+        export STRIP_FORMAT="${STRIP_FORMAT:-flz}"
+        if [ "$(cat temp/source 2>/dev/null)" != "$img_dir" ]
+        then
+            rm -rf "$psf_dir" "$resized_dir" "$JOURNAL"
+            mkdir -p temp
+            echo "$img_dir" > temp/source
+        fi
+
+        mkdir -p $psf_dir $resized_dir
+
+        # -m merges the whole resized_dir, strips of frames no longer in img_dir or left
+        # in another STRIP_FORMAT by an earlier run must not end up in the panorama
+        keep=" "
+        for file in $(ls -1 $img_dir)
+        do
+            keep="$keep${file%.bmp}_resized.$STRIP_FORMAT "
+        done
+        for file in $(ls -1 $resized_dir)
+        do
+            case "$keep" in
+                *" $file "*) ;;
+                *) rm -f "$resized_dir/$file" ;;
+            esac
+        done
 
         $0 -p "$img_dir" "$psf_dir" && $0 -s "$img_dir" "$psf_dir" "$resized_dir" && $0 -m "$resized_dir" "$out_img"
         ;;
 
+    -b)
+        # batch of scans
+        shift
+        build/flt --batch "$@"
+        ;;
+
     *)
         # wrong
         print_help
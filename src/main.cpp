@@ -2,8 +2,15 @@
 #include <iomanip>
 #include <vector>
 #include <cstring>
+#include <algorithm>
 #include "../include/bmp.hpp"
 #include "../include/util.hpp"
+#include "../include/server.hpp"
+#include "../include/live.hpp"
+#include "../include/batch.hpp"
+#include "../include/shard.hpp"
+#include "../include/journal.hpp"
+#include "../include/pyramid.hpp"
 
 using namespace std;
 
@@ -13,49 +20,145 @@ int main(int argc, char *argv[]){
 
     unsigned int resolution = 10;  // thickness of horizontal strips
 
-    if(argc < 5){
+    if(argc < 3){
         print_help(argv[0]);
         return 1;
     }
 
-    if(!strcmp(argv[1], "--psf")){
-        if(argc != 1+4) print_help(argv[0]);
+    // optional trailing '--band <rows>' for --psf, --scale and --coordinate,
+    // '--sparse <step>', '--mask <tol>' and '--metric <name>' for --psf and --coordinate,
+    // '--journal <file>' for --psf and --scale. other operations take none of them, there
+    // they would be file names
+    vector<string> options;
+    if(!strcmp(argv[1], "--psf")) options = { "--band", "--sparse", "--mask", "--metric", "--journal" };
+    else if(!strcmp(argv[1], "--scale")) options = { "--band", "--journal" };
+    else if(!strcmp(argv[1], "--coordinate")) options = { "--band", "--sparse", "--mask", "--metric" };
 
-        BMP_image a(argv[2]);
-        BMP_image b(argv[3]);
-        int maxshift = 0;
-
-        auto psf = calc_psf(a, b, &maxshift, resolution);
+    unsigned int band_rows = 0;
+    unsigned int sparse_step = 0;
+    int bg_tol = -1;
+    metric_t metric = METRIC_SAD;
+    const char* journal_file = nullptr;
+    while(argc >= 1+6 && find(options.begin(), options.end(), argv[argc-2]) != options.end()){
+        if(!strcmp(argv[argc-2], "--band")) band_rows = atoi(argv[argc-1]);
+        else if(!strcmp(argv[argc-2], "--sparse")) sparse_step = atoi(argv[argc-1]);
+        else if(!strcmp(argv[argc-2], "--mask")) bg_tol = atoi(argv[argc-1]);
+        else if(!strcmp(argv[argc-2], "--metric")) metric = parse_metric(argv[argc-1]);
+        else journal_file = argv[argc-1];
+        argc -= 2;
+    }
 
-        // psf file format: n_strips \n thickness \n maxshift \n psf1 \n ... psfN \n
-        write_psf(argv[4], psf, resolution, maxshift);
+    for(int i=2; i<argc; ++i){
+        for(auto o : { "--band", "--sparse", "--mask", "--metric", "--journal" }){
+            if(strcmp(argv[i], o)) continue;
+            cerr << "Option '" << o << "' is not accepted by " << argv[1] << " here (see --help)" << endl;
+            return 1;
+        }
     }
-    else if(!strcmp(argv[1], "--scale")){
-        if(argc != 1+4) print_help(argv[0]);
-        
-        BMP_image a(argv[2]);
-        int maxshift = 0;
 
-        auto psf = read_psf(argv[3], &resolution, &maxshift);
+    // file and format errors in the image code are thrown, they end the program here
+    try{
+        if(!strcmp(argv[1], "--psf")){
+            if(argc != 1+4){
+                print_help(argv[0]);
+                return 1;
+            }
 
-        cut_strip(psf_resize(a, psf, resolution), maxshift).save_as(argv[4]);
-        
-    }
-    else if(!strcmp(argv[1], "--merge")){
-        vector<const BMP_image*> images;
-        images.reserve(argc-3);
+            // a journaled result is redone if any option it depends on changed
+            vector<string> inputs{ argv[2], argv[3] };
+            string options = "psf " + to_string(resolution) + " " + to_string(band_rows) + " " + to_string(sparse_step)
+                             + " " + to_string(bg_tol) + " " + to_string((int) metric);
+            if(journal_file && journal(journal_file).done(argv[4], inputs, options)) return 0;
+
+            op_psf(argv[2], argv[3], argv[4], resolution, band_rows, sparse_step, bg_tol, metric);
+
+            if(journal_file) journal(journal_file).commit(argv[4], inputs, options);
+        }
+        else if(!strcmp(argv[1], "--scale")){
+            if(argc != 1+4){
+                print_help(argv[0]);
+                return 1;
+            }
 
-        for(int arg=3; arg<argc; ++arg){
-            images.push_back(new BMP_image(argv[arg]));
+            vector<string> inputs{ argv[2], argv[3] };
+            string options = "scale " + to_string(resolution) + " " + to_string(band_rows);
+            if(journal_file && journal(journal_file).done(argv[4], inputs, options)) return 0;
+
+            op_scale(argv[2], argv[3], argv[4], band_rows);
+
+            if(journal_file) journal(journal_file).commit(argv[4], inputs, options);
+        }
+        else if(!strcmp(argv[1], "--merge")){
+            if(argc < 4){
+                print_help(argv[0]);
+                return 1;
+            }
+
+            op_merge(argv[2], vector<const char*>(argv+3, argv+argc));
+        }
+        else if(!strcmp(argv[1], "--pyramid")){
+            if(argc < 4){
+                print_help(argv[0]);
+                return 1;
+            }
+
+            op_pyramid(argv[2], vector<const char*>(argv+3, argv+argc));
+        }
+        else if(!strcmp(argv[1], "--live")){
+            live_panorama pano(argv[2], resolution);
+
+            if(argc > 3) live_from_dir(pano, argv[3]);
+            else live_from_stdin(pano);
+        }
+        else if(!strcmp(argv[1], "--batch")){
+            if(argc < 5 || (argc - 3) % 2){
+                print_help(argv[0]);
+                return 1;
+            }
+
+            // a worker per core, each correlation keeps CORRELATE_PARTS threads of correlate_pool() busy
+            unsigned int n_cores = thread::hardware_concurrency();
+            batch_scheduler batch((uint64_t) atoi(argv[2]) << 20, n_cores, n_cores / CORRELATE_PARTS, resolution);
+            for(int arg=3; arg<argc; arg+=2) batch.add_scan(argv[arg], argv[arg+1]);
+            return batch.run() ? 0 : 1;
+        }
+        else if(!strcmp(argv[1], "--coordinate")){
+            if(argc != 1+4 && argc != 1+5){
+                print_help(argv[0]);
+                return 1;
+            }
+
+            shard_options opt;
+            opt.band_rows = band_rows;
+            opt.sparse_step = sparse_step;
+            opt.bg_tol = bg_tol;
+            opt.metric = metric;
+
+            return coordinate_psf(argv[2], argv[3], argv[4], argc > 5 ? atoi(argv[5]) : 30, opt) ? 0 : 1;
+        }
+        else if(!strcmp(argv[1], "--work")){
+            work_psf(argv[2], resolution);
+        }
+        else if(!strcmp(argv[1], "--serve")){
+            job_server server(argv[2], argc > 3 ? atoi(argv[3]) : 4, resolution);
+            server.serve();
+        }
+        else if(!strcmp(argv[1], "--submit")){
+            if(argc < 4){
+                print_help(argv[0]);
+                return 1;
+            }
+
+            return submit_job(argv[2], vector<string>(argv+3, argv+argc)) ? 0 : 1;
+        }
+        else{
+            print_help(argv[0]);
+            return 1;
         }
-        merge(images).save_as(argv[2]);
-        
-        // free memory
-        for(int i=0; i<images.size(); ++i) delete images[i];
     }
-    else{
-        print_help(argv[0]);
-        return 1;
+    catch(const std::exception& e){
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
     }
 
     return 0;
@@ -0,0 +1,142 @@
+// round trip of the FLZ codec (flz.hpp)
+//
+// rows with runs longer than a token can hold, literal stretches around the 128 word
+// limit and random noise are written with FLZ_writer and read back with FLZ_reader,
+// whole and in bands that start and end inside and across FLZ_BLOCK boundaries
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <filesystem>
+#include <cstdlib>
+#include <unistd.h>
+#include "../include/flz.hpp"
+
+using namespace std;
+
+
+mt19937 rng(2019);
+int failed = 0;
+
+
+pixel4 random_pixel(){
+    uniform_int_distribution<int> c(0, 255);
+    return pixel4(c(rng), c(rng), c(rng), c(rng));
+}
+
+
+// row r of the test image, each row exercises other token lengths
+void make_row(int r, pixel4* row, unsigned int w){
+    switch(r % 6){
+        // flat, runs of zero differences far longer than 129
+        case 0:
+            fill(row, row + w, pixel4(240, 240, 240));
+            break;
+
+        // gradient, runs of a constant non-zero difference
+        case 1:
+            for(int i=0; i<w; ++i) row[i] = pixel4(i, 2*i, 255 - i, 255);
+            break;
+
+        // literal stretches of 127, 128 and 129 words between flat runs
+        case 2: {
+            unsigned int i = 0;
+            for(unsigned int lit : { 127, 128, 129 }){
+                for(int k=0; k<lit && i<w; ++k) row[i++] = random_pixel();
+                for(int k=0; k<10 && i<w; ++k) row[i++] = pixel4(0, 0, 0);
+            }
+            while(i < w) row[i++] = random_pixel();
+            break;
+        }
+
+        // a flat run of exactly 129, then one of 130
+        case 3:
+            for(int i=0; i<w; ++i) row[i] = i < 129 ? pixel4(1, 2, 3) : i < 259 ? pixel4(4, 5, 6) : random_pixel();
+            break;
+
+        // noise, literals only
+        default:
+            for(int i=0; i<w; ++i) row[i] = random_pixel();
+    }
+}
+
+
+bool same(const pixel4& p, const pixel4& q){
+    return p.r == q.r && p.g == q.g && p.b == q.b && p.a == q.a;
+}
+
+
+void check(const char* what, const pixel4* res, const pixel4* ref, size_t n){
+    for(size_t i=0; i<n; ++i){
+        if(!same(res[i], ref[i])){
+            cerr << what << ": pixel " << i << " is " << res[i] << ", expected " << ref[i] << endl;
+            ++failed;
+            return;
+        }
+    }
+}
+
+
+// writes an image of width w and reads it back, whole and in bands
+void round_trip(const string& file, unsigned int w){
+    // more than two blocks, the last one partial
+    unsigned int h = 2*FLZ_BLOCK + 37;
+    vector<pixel4> img(w * h);
+    for(int r=0; r<h; ++r) make_row(r, &img[r * w], w);
+
+    // written in uneven bands, like BMP_writer does
+    {
+        FLZ_writer out(file.c_str(), w, h);
+        for(unsigned int r0=0; r0<h; r0+=50) out.write_rows(&img[r0 * w], min(50u, h - r0));
+        out.finish();
+    }
+
+    FLZ_reader in(file.c_str());
+    if(in.header.width != w || in.header.height != h){
+        cerr << "header: " << in.header.width << "x" << in.header.height << ", expected " << w << "x" << h << endl;
+        ++failed;
+        return;
+    }
+
+    string what = "width " + to_string(w);
+    vector<pixel4> res(w * h);
+
+    in.read_rows(0, h, res.data());
+    check((what + ", all rows").c_str(), res.data(), img.data(), w * h);
+
+    // bands inside a block, ending on and crossing block boundaries, and the last row
+    vector<pair<unsigned int, unsigned int>> bands{ { 5, 10 }, { FLZ_BLOCK-1, 2 }, { FLZ_BLOCK-10, FLZ_BLOCK+20 },
+                                                    { FLZ_BLOCK, FLZ_BLOCK }, { 1, h-1 }, { h-1, 1 } };
+    for(auto b : bands){
+        in.read_rows(b.first, b.second, res.data());
+        check((what + ", rows " + to_string(b.first) + " +" + to_string(b.second)).c_str(), res.data(), &img[b.first * w], w * b.second);
+    }
+}
+
+
+int main(){
+
+    string file = (filesystem::temp_directory_path() / ("flz_test" + to_string(getpid()) + ".flz")).string();
+
+    for(unsigned int w : { 1u, 2u, 128u, 129u, 500u }){
+        // a row that doesn't decode throws, a failure like a wrong pixel
+        try{
+            round_trip(file, w);
+        }
+        catch(const exception& e){
+            cerr << "width " << w << ": " << e.what() << endl;
+            ++failed;
+        }
+    }
+
+    filesystem::remove(file);
+
+    if(failed){
+        cerr << failed << " flz checks failed" << endl;
+        return EXIT_FAILURE;
+    }
+
+    cout << "flz checks passed" << endl;
+    return 0;
+}